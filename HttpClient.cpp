@@ -9,13 +9,64 @@
 #include <sstream>
 #include <fstream>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
 #include <vector>
 #include <deque>
+#include <set>
+#include <algorithm>
+#include <limits>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <cstdint>
+
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(FTX_USE_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 
 
 const char* TEMP_FILE_SUFFIX = ".ftxtmp";
 const char* FILE_LOG_SUFFIX = ".ftxlog";
+const char* UPLOAD_LOG_SUFFIX = ".ftxuplog";
 const long CONNECTS_FOR_DOWNLOAD = 10;
+const long long MIN_BUCKET_BURST = 16 * 1024;
+const long PAUSED_WAIT_TIMEOUT = 10;
+const size_t LATENCY_SAMPLES = 1024;
+const size_t MIN_LATENCY_SAMPLES = 32;
+const int MIRROR_MAX_FAILURES = 3;
+const double MIRROR_THROUGHPUT_WEIGHT = 0.3;
+const size_t WRITE_BUFFER_ALIGNMENT = 4096;
+const unsigned IO_URING_ENTRIES = 64;
+const size_t OBJECT_POOL_CAPACITY = 256;
+const size_t OBJECT_POOL_CACHE_BATCH = 16;
+const char* DELTA_MANIFEST_MAGIC = "FTXDELTA";
+const uint32_t DELTA_MANIFEST_VERSION = 1;
+const long DELTA_MAX_RANGE = 8 * 1024 * 1024;
+const long DELTA_MIN_BLOCKS_PER_THREAD = 256;
+const uint64_t XXH_PRIME64_1 = 11400714785074694791ULL;
+const uint64_t XXH_PRIME64_2 = 14029467366897019727ULL;
+const uint64_t XXH_PRIME64_3 = 1609587929392839161ULL;
+const uint64_t XXH_PRIME64_4 = 9650029242287828579ULL;
+const uint64_t XXH_PRIME64_5 = 2870177450012600261ULL;
+const char* BULK_STATE_MAGIC = "FTXBULK1";
+const size_t BULK_STATE_HEADER = 8 + sizeof(uint64_t) * 2;
+const long BULK_MAX_TRANSFERS = 32;
+const long BULK_BLOCK_SIZE = 20 * 1024 * 1024;
+const char* DOWNLOAD_QUEUE_FILE = "/download.ftxqueue";
+const long long DOWNLOAD_QUEUE_DISK_RESERVE = 64 * 1024 * 1024;
+const long DOWNLOAD_QUEUE_SPACE_RETRY_MS = 5000;
+const uint32_t DOWNLOAD_QUEUE_MAX_RECORD = 64 * 1024;
 
 ftx::HttpParams::HttpParams(const std::map<std::string, std::string> &params)
 : _params(params)
@@ -47,6 +98,88 @@ std::string ftx::HttpParams::ToString()
     return ss.str();
 }
 
+class ftx::HttpHeaders::List
+{
+public:
+    ~List()
+    {
+        curl_slist_free_all(slist);
+    }
+
+    std::vector<std::string> lines;
+    curl_slist* slist = nullptr;
+};
+
+/* a list handed to a request is never changed, Add builds the next one */
+void ftx::HttpHeaders::Add(const std::string &name, const std::string &value)
+{
+    std::shared_ptr<List> next = std::make_shared<List>();
+    if (list != nullptr)
+    {
+        next->lines = list->lines;
+    }
+    next->lines.push_back(value.empty() ? name + ":" : name + ": " + value);
+
+    for (auto& line: next->lines)
+    {
+        next->slist = curl_slist_append(next->slist, line.c_str());
+    }
+
+    list = next;
+}
+
+/* FNV-1a of the lower case name */
+static size_t headerNameHash(const char* name, size_t size)
+{
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ (unsigned char)tolower((unsigned char)name[i])) * 16777619u;
+    }
+
+    return hash;
+}
+
+ftx::HeaderView ftx::HttpResponseHeaders::Get(const std::string &name) const
+{
+    size_t hash = headerNameHash(name.data(), name.size());
+    for (size_t i = 0; i < fields.size(); ++i)
+    {
+        const Field& field = fields[i];
+        if (field.hash == hash && field.nameSize == name.size()
+            && strncasecmp(raw.data() + field.nameBegin, name.data(), name.size()) == 0)
+        {
+            return Value(i);
+        }
+    }
+
+    return HeaderView();
+}
+
+ftx::HeaderView ftx::HttpResponseHeaders::Name(size_t index) const
+{
+    HeaderView view;
+    if (index < fields.size())
+    {
+        view.data = raw.data() + fields[index].nameBegin;
+        view.size = fields[index].nameSize;
+    }
+
+    return view;
+}
+
+ftx::HeaderView ftx::HttpResponseHeaders::Value(size_t index) const
+{
+    HeaderView view;
+    if (index < fields.size())
+    {
+        view.data = raw.data() + fields[index].valueBegin;
+        view.size = fields[index].valueSize;
+    }
+
+    return view;
+}
+
 // ========================================================
 
 namespace ftx {
@@ -87,7 +220,7 @@ namespace ftx {
         void PushToForeground(std::function<void()> tasks)
         {
             foregroundMtx.lock();
-            foregroundTasks.push_back(tasks);
+            foregroundTasks.push_back(std::move(tasks));
             foregroundMtx.unlock();
         }
 
@@ -115,10 +248,46 @@ namespace ftx {
         std::vector<std::function<void()>> backgroundTasks;
         std::vector<std::function<void()>> foregroundTasks;
 
-        friend class HttpClient;
+        friend class HttpEngine::Impl;
+        friend class DiskWriter;
     };
 
-    HttpTaskManager httpTaskManager;
+    /* delayed tasks of the http thread */
+    class TimerQueue
+    {
+    public:
+        void Push(long delay_ms, std::function<void()> task)
+        {
+            auto due = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay_ms);
+            tasks.insert(std::make_pair(due, task));
+        }
+
+        void PerformDue()
+        {
+            auto now = std::chrono::steady_clock::now();
+            while (!tasks.empty() && tasks.begin()->first <= now)
+            {
+                auto task = tasks.begin()->second;
+                tasks.erase(tasks.begin());
+                task();
+            }
+        }
+
+        /* -1 if nothing is scheduled */
+        long NextTimeout() const
+        {
+            if (tasks.empty())
+            {
+                return -1;
+            }
+
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(tasks.begin()->first - std::chrono::steady_clock::now());
+            return std::max(0L, (long)left.count());
+        }
+
+    private:
+        std::multimap<std::chrono::steady_clock::time_point, std::function<void()>> tasks;
+    };
 
     // ==============================================
 
@@ -127,60 +296,324 @@ namespace ftx {
         std::vector<std::tuple<long, long>> all;
     };
 
+    /* the file side of one block attempt, owned by the disk writer once the block is finished */
+    struct BlockSink
+    {
+        int fd;
+        bool resume;
+        size_t index;
+        std::string logfile;
+        long committed;
+        std::map<long, long> written;
+        int pending;
+        bool closed;
+        bool failed;
+        std::function<void(bool)> flushed;
+    };
+
     struct DownloadBlock
     {
+        HttpEngine::Impl* engine;
         CURL* handle;
-        FILE* fd;
+        std::shared_ptr<BlockSink> sink;
+        char* buffer;
+        size_t buffered;
+        long bufferStart;
         long start;
         long end;
         bool resume;
+        bool ranged;
+        bool unranged;  /* a 200 for part of the file, retrying cannot help */
         size_t index;
+        size_t mirror;
+        size_t bulk;
         std::string filepath;
+        std::string host;
     };
 
     struct RequestStream
     {
+        HttpEngine::Impl* engine;
         CURL* handle;
         size_t id;
-        std::stringstream stream;
+        std::string host;
+        std::string body;
+        HttpResponseHeaders headers;
+    };
+
+    struct UploadBlock
+    {
+        HttpEngine::Impl* engine;
+        CURL* handle;
+        const char* data;
+        size_t length;
+        size_t sent;
+        size_t index;
+        bool resume;
+        std::string filepath;
+        std::string host;
+        std::string tag;
+    };
+
+    /* a HEAD on the multi asking each mirror in turn for the length of filepath */
+    struct LengthProbe
+    {
+        std::vector<std::string> urls;
+        size_t next;
+        std::string filepath;
+        HttpOption opt;
+        std::function<void(long)> done;
+    };
+
+    /* the manifest of a delta download, fetched on the multi before the base file is matched */
+    struct ManifestFetch
+    {
+        size_t id;
+        std::string url;
+        std::string basepath;
+        std::string filepath;
+        HttpOption opt;
+        std::string body;
     };
 
     enum class RequestType
     {
         HttpRequest,
-        HttpDownload
+        HttpDownload,
+        HttpUpload,
+        HttpPrewarm,
+        HttpBulk,
+        HttpProbe,
+        HttpManifest
     };
 
     struct RequestTypeOption
     {
         RequestType type;
         void* data;
+        std::shared_ptr<HttpHeaders::List> headers;
+        std::shared_ptr<curl_slist> resolve;
     };
 
-    std::vector<DownloadBlock*> blockPool;
-    static DownloadBlock* takeDownloadBlock(CURL* handle, long start, long end, bool resume, size_t index, const std::string& filepath)
+    /* fixed arena of constructed objects, per thread caches in front of a locked free list, heap past the cap */
+    template <typename T>
+    class ObjectPool
     {
-        DownloadBlock* block;
-        if (!blockPool.empty())
+        /* a thread that exits hands its objects back, an engine that stops does not shrink the shared pool */
+        struct Cache
+        {
+            ObjectPool* owner = nullptr;
+            size_t generation = 0;
+            std::vector<T*> items;
+
+            ~Cache()
+            {
+                if (owner != nullptr)
+                {
+                    owner->GiveBack(items, generation);
+                }
+            }
+        };
+
+    public:
+        void SetCapacity(size_t count)
         {
-            block = blockPool.back();
-            blockPool.pop_back();
+            std::lock_guard<std::mutex> lock(mtx);
+            capacity = count;
         }
-        else
+
+        /* builds the arena, objects are never freed one by one after this */
+        void Reserve()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (arena != nullptr)
+            {
+                return ;
+            }
+
+            T* objects = new T[capacity];
+            arenaSize = capacity;
+            arena = objects;
+            idle.reserve(capacity);
+            for (size_t i = 0; i < capacity; ++i)
+            {
+                idle.push_back(objects + capacity - 1 - i);
+            }
+        }
+
+        T* Take()
+        {
+            Cache& cache = localCache();
+            if (cache.items.empty())
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                size_t n = std::min(idle.size(), OBJECT_POOL_CACHE_BATCH);
+                cache.items.insert(cache.items.end(), idle.end() - n, idle.end());
+                idle.resize(idle.size() - n);
+            }
+
+            if (cache.items.empty())
+            {
+                ++overflow;
+                return new T();
+            }
+
+            T* obj = cache.items.back();
+            cache.items.pop_back();
+            ++inUse;
+            return obj;
+        }
+
+        void Putback(T* obj)
+        {
+            if (!owns(obj))
+            {
+                if (!ownedByRetired(obj))
+                {
+                    delete obj;
+                    --overflow;
+                }
+                return ;
+            }
+
+            --inUse;
+
+            Cache& cache = localCache();
+            cache.items.push_back(obj);
+            if (cache.items.size() >= OBJECT_POOL_CACHE_BATCH * 2)
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                idle.insert(idle.end(), cache.items.end() - OBJECT_POOL_CACHE_BATCH, cache.items.end());
+                cache.items.resize(cache.items.size() - OBJECT_POOL_CACHE_BATCH);
+            }
+        }
+
+        /* arena plus objects handed out past the cap */
+        size_t Memory() const
+        {
+            return (arenaSize + overflow) * sizeof(T);
+        }
+
+        /* caches of other threads are dropped lazily; an arena with objects still out is kept
+         * until they come back, deleting them one by one would free memory new[] never gave out */
+        void Clear()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (inUse > 0)
+            {
+                retired.push_back(std::make_tuple(arena.load(), arenaSize.load(), inUse.load()));
+            }
+            else
+            {
+                delete[] arena.load();
+            }
+
+            arena = nullptr;
+            arenaSize = 0;
+            inUse = 0;
+            idle.clear();
+            ++generation;
+        }
+
+    private:
+        Cache& localCache()
+        {
+            static thread_local Cache cache;
+            if (cache.owner != this || cache.generation != generation)
+            {
+                if (cache.owner != nullptr)
+                {
+                    cache.owner->GiveBack(cache.items, cache.generation);
+                }
+
+                cache.owner = this;
+                cache.generation = generation;
+                cache.items.clear();
+            }
+
+            return cache;
+        }
+
+        /* objects of an arena that has been cleared since are dropped with the cache */
+        void GiveBack(std::vector<T*>& items, size_t from)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (from == generation && arena != nullptr)
+            {
+                idle.insert(idle.end(), items.begin(), items.end());
+            }
+            items.clear();
+        }
+
+        bool owns(T* obj) const
+        {
+            std::less<T*> less;
+            T* objects = arena;
+            return objects != nullptr && !less(obj, objects) && less(obj, objects + arenaSize);
+        }
+
+        bool ownedByRetired(T* obj)
         {
-            block = new DownloadBlock();
+            std::lock_guard<std::mutex> lock(mtx);
+            std::less<T*> less;
+            for (auto iter = retired.begin(); iter != retired.end(); ++iter)
+            {
+                T* objects = std::get<0>(*iter);
+                if (!less(obj, objects) && less(obj, objects + std::get<1>(*iter)))
+                {
+                    if (--std::get<2>(*iter) == 0)
+                    {
+                        delete[] objects;
+                        retired.erase(iter);
+                    }
+                    return true;
+                }
+            }
+
+            return false;
         }
 
+        std::mutex mtx;
+        std::vector<T*> idle;
+        std::vector<std::tuple<T*, size_t, size_t>> retired;
+        std::atomic<T*> arena{nullptr};
+        std::atomic<size_t> arenaSize{0};
+        std::atomic<size_t> inUse{0};
+        std::atomic<size_t> overflow{0};
+        std::atomic<size_t> generation{0};
+        size_t capacity = OBJECT_POOL_CAPACITY;
+    };
+
+    ObjectPool<DownloadBlock> blockPool;
+    /* the block itself is pooled, its sink is not: one shared sink per attempt outlives the block on the disk writer */
+    static DownloadBlock* takeDownloadBlock(CURL* handle, long start, long end, bool resume, size_t index, const std::string& filepath)
+    {
+        DownloadBlock* block = blockPool.Take();
+
         std::string tmpfilepath = HttpClient::FilePath2TmpPath(filepath);
-        FILE* fd = fopen(tmpfilepath.c_str(), "wb");
-        fseek(fd, start, SEEK_SET);
+        std::shared_ptr<BlockSink> sink = std::make_shared<BlockSink>();
+        sink->fd = open(tmpfilepath.c_str(), O_WRONLY | O_CREAT, 0644);
+        sink->resume = resume;
+        sink->index = index;
+        sink->logfile = HttpClient::FileLogFullPath(filepath);
+        sink->committed = start;
+        sink->pending = 0;
+        sink->closed = false;
+        sink->failed = sink->fd < 0;
 
         block->handle = handle;
-        block->fd = fd;
+        block->sink = sink;
+        block->buffer = nullptr;
+        block->buffered = 0;
+        block->bufferStart = start;
         block->start = start;
         block->end = end;
         block->resume = resume;
+        block->ranged = false;
+        block->unranged = false;
         block->index = index;
+        block->mirror = 0;
+        block->bulk = 0;
         block->filepath = filepath;
 
         return block;
@@ -188,35 +621,14 @@ namespace ftx {
 
     static void putbackDownloadBlock(DownloadBlock* block)
     {
-        fflush(block->fd);
-        fclose(block->fd);
-
-        blockPool.push_back(block);
-    }
-
-    static void clearDownloadBlockPool()
-    {
-        for(auto block: blockPool)
-        {
-            delete block;
-        }
-
-        blockPool.clear();
+        block->sink.reset();
+        blockPool.Putback(block);
     }
 
-    std::vector<RequestStream*> reqStreamPool;
+    ObjectPool<RequestStream> reqStreamPool;
     static RequestStream* takeRequestStream(CURL* handle, size_t id)
     {
-        RequestStream* stream;
-        if (!reqStreamPool.empty())
-        {
-            stream = reqStreamPool.back();
-            reqStreamPool.pop_back();
-        }
-        else
-        {
-            stream = new RequestStream();
-        }
+        RequestStream* stream = reqStreamPool.Take();
 
         stream->handle = handle;
         stream->id = id;
@@ -226,33 +638,36 @@ namespace ftx {
 
     static void putbackRequestStream(RequestStream* stream)
     {
-        stream->stream.clear();
-        reqStreamPool.push_back(stream);
+        stream->body.clear();
+        reqStreamPool.Putback(stream);
     }
 
-    static void clearRequestStream()
+    ObjectPool<UploadBlock> uploadBlockPool;
+    static UploadBlock* takeUploadBlock(CURL* handle, size_t index, bool resume, const std::string& filepath)
     {
-        for(auto stream: reqStreamPool)
-        {
-            delete stream;
-        }
+        UploadBlock* block = uploadBlockPool.Take();
+
+        block->handle = handle;
+        block->data = nullptr;
+        block->length = 0;
+        block->sent = 0;
+        block->index = index;
+        block->resume = resume;
+        block->filepath = filepath;
+        block->tag.clear();
 
-        reqStreamPool.clear();
+        return block;
+    }
+
+    static void putbackUploadBlock(UploadBlock* block)
+    {
+        uploadBlockPool.Putback(block);
     }
 
-    std::vector<RequestTypeOption*> requestOptionPool;
+    ObjectPool<RequestTypeOption> requestOptionPool;
     static RequestTypeOption* takeRequestOption(RequestType type, void* data)
     {
-        RequestTypeOption* opt;
-        if (!requestOptionPool.empty())
-        {
-            opt = requestOptionPool.back();
-            requestOptionPool.pop_back();
-        }
-        else
-        {
-            opt = new RequestTypeOption();
-        }
+        RequestTypeOption* opt = requestOptionPool.Take();
 
         opt->type = type;
         opt->data = data;
@@ -262,7 +677,7 @@ namespace ftx {
 
     static void putbackRequestOption(RequestTypeOption* opt)
     {
-        if (opt->type == RequestType::HttpDownload)
+        if (opt->type == RequestType::HttpDownload || opt->type == RequestType::HttpBulk)
         {
             putbackDownloadBlock((DownloadBlock*)opt->data);
         }
@@ -270,18 +685,54 @@ namespace ftx {
         {
             putbackRequestStream((RequestStream*) opt->data);
         }
+        else if (opt->type == RequestType::HttpUpload)
+        {
+            putbackUploadBlock((UploadBlock*) opt->data);
+        }
+        else if (opt->type == RequestType::HttpProbe)
+        {
+            delete (LengthProbe*) opt->data;
+        }
+        else if (opt->type == RequestType::HttpManifest)
+        {
+            delete (ManifestFetch*) opt->data;
+        }
+
+        opt->headers.reset();
+        opt->resolve.reset();
+        requestOptionPool.Putback(opt);
+    }
+
+    /* the pools are shared by every engine, built by the first to start and freed by the last to stop */
+    std::mutex objectPoolMtx;
+    int objectPoolUsers = 0;
+
+    static void reserveObjectPools()
+    {
+        std::lock_guard<std::mutex> lock(objectPoolMtx);
+        if (objectPoolUsers++ > 0)
+        {
+            return ;
+        }
 
-        requestOptionPool.push_back(opt);
+        blockPool.Reserve();
+        reqStreamPool.Reserve();
+        uploadBlockPool.Reserve();
+        requestOptionPool.Reserve();
     }
 
-    static void clearRequestOptionPool()
+    static void clearObjectPools()
     {
-        for(auto opt: requestOptionPool)
+        std::lock_guard<std::mutex> lock(objectPoolMtx);
+        if (--objectPoolUsers > 0)
         {
-            delete opt;
+            return ;
         }
 
-        requestOptionPool.clear();
+        blockPool.Clear();
+        reqStreamPool.Clear();
+        uploadBlockPool.Clear();
+        requestOptionPool.Clear();
     }
 
     class FileTool
@@ -300,21 +751,26 @@ namespace ftx {
             }
 
             size_t size = 0;
-            ifs >> size;
+            ifs.read((char*)&size, sizeof(size));
 
-            for (auto i = 0; i < size; ++i)
+            for (size_t i = 0; i < size && ifs.good(); ++i)
             {
                 long begin = 0;
                 long end = 0;
-                ifs >> begin;
-                ifs >> end;
+                ifs.read((char*)&begin, sizeof(begin));
+                ifs.read((char*)&end, sizeof(end));
 
-                if (begin < end)
+                if (ifs.good())
                 {
                     blockList.all.push_back(std::make_tuple(begin, end));
                 }
             }
 
+            if (blockList.all.size() != size)
+            {
+                blockList.all.clear();
+            }
+
             ifs.close();
 
             return blockList;
@@ -331,15 +787,15 @@ namespace ftx {
             }
 
             size_t size = blockList.all.size();
-            ofs << size;
+            ofs.write((const char*)&size, sizeof(size));
             for (auto block: blockList.all)
             {
                 long begin = 0;
                 long end = 0;
                 std::tie(begin, end) = block;
 
-                ofs << begin;
-                ofs << end;
+                ofs.write((const char*)&begin, sizeof(begin));
+                ofs.write((const char*)&end, sizeof(end));
             }
 
             ofs.flush();
@@ -349,627 +805,5726 @@ namespace ftx {
         static void UpdateBlocks(const std::string& logfile, size_t index, long start)
         {
             std::ofstream ofs;
-            ofs.open(logfile, std::ios::out | std::ios::binary);
+            ofs.open(logfile, std::ios::in | std::ios::out | std::ios::binary);
+
+            if (!ofs.is_open())
+            {
+                return ;
+            }
 
             size_t pos = sizeof(size_t);
             pos += index * sizeof(long) * 2;
 
             ofs.seekp(pos);
 
-            ofs << start;
+            ofs.write((const char*)&start, sizeof(start));
 
             ofs.flush();
             ofs.close();
         }
 
-        static void DowdloadFinish(const std::string& filepath)
+        static std::map<size_t, std::string> LoadUploadParts(const std::string& logfile, const std::string& upload_id)
         {
-            std::string tmp_file_path = HttpClient::FilePath2TmpPath(filepath);
-            std::rename(tmp_file_path.c_str(), filepath.c_str());
-            std::string log_file_path = HttpClient::FileLogFullPath(filepath);
-            std::remove(log_file_path.c_str());
-        }
+            std::map<size_t, std::string> parts;
 
-        static void ClearTempAndLogFiles(const std::string& filepath)
-        {
-            std::string tmp_file_path = HttpClient::FilePath2TmpPath(filepath);
-            std::remove(tmp_file_path.c_str());
-            std::string log_file_path = HttpClient::FileLogFullPath(filepath);
-            std::remove(log_file_path.c_str());
-        }
+            std::ifstream ifs;
+            ifs.open(logfile, std::ios::in);
 
-        friend class HttpClient;
-    };
+            if (!ifs.is_open())
+            {
+                return parts;
+            }
 
-    class DownloadDashboard
-    {
-    public:
-        void UpdateInfo(const std::string& filepath, size_t index, double speed, double size)
-        {
-            downloadInfo[filepath][index] = std::make_tuple(speed, size);
-        }
+            std::string id;
+            std::getline(ifs, id);
+            if (id != upload_id)
+            {
+                return parts;
+            }
 
-        void Remove(const std::string& filepath)
-        {
-            downloadInfo.erase(filepath);
+            size_t index = 0;
+            std::string tag;
+            while (ifs >> index >> tag)
+            {
+                parts[index] = tag;
+            }
+
+            ifs.close();
+
+            return parts;
         }
 
-        std::tuple<double, double> SpeedAndSize(const std::string& filepath)
+        static void WriteUploadHeader(const std::string& logfile, const std::string& upload_id)
         {
-            auto curr_file = downloadInfo[filepath];
-            double speed = 0;
-            double size = 0;
-            for (auto info: curr_file)
+            std::ofstream ofs;
+            ofs.open(logfile, std::ios::out | std::ios::trunc);
+
+            if (!ofs.is_open())
             {
-                speed += std::get<0>(info.second);
-                size += std::get<1>(info.second);
+                return ;
             }
 
-            return std::make_tuple(speed, size);
-        };
+            ofs << upload_id << "\n";
 
-        double Speed(const std::string& filepath)
+            ofs.flush();
+            ofs.close();
+        }
+
+        static void AppendUploadPart(const std::string& logfile, size_t index, const std::string& tag)
         {
-            auto curr_file = downloadInfo[filepath];
-            double speed = 0;
-            for (auto info: curr_file)
+            std::ofstream ofs;
+            ofs.open(logfile, std::ios::out | std::ios::app);
+
+            if (!ofs.is_open())
             {
-                speed += std::get<0>(info.second);
+                return ;
             }
 
-            return speed;
+            ofs << index << " " << (tag.empty() ? "-" : tag) << "\n";
+
+            ofs.flush();
+            ofs.close();
         }
 
-        double Size(const std::string& filepath)
+        /* "FTXBULK1", item count, manifest key, then one bit per finished item; empty when it belongs to another manifest */
+        static std::vector<unsigned char> LoadBulkState(const std::string& statepath, uint64_t count, uint64_t key)
         {
-            auto curr_file = downloadInfo[filepath];
-            double size = 0;
-            for (auto info: curr_file)
+            std::vector<unsigned char> done;
+
+            std::ifstream ifs;
+            ifs.open(statepath, std::ios::in | std::ios::binary);
+
+            if (!ifs.is_open())
             {
-                size += std::get<1>(info.second);
+                return done;
             }
 
-            return size;
+            char magic[8];
+            uint64_t saved_count = 0;
+            uint64_t saved_key = 0;
+            ifs.read(magic, sizeof(magic));
+            ifs.read((char*)&saved_count, sizeof(saved_count));
+            ifs.read((char*)&saved_key, sizeof(saved_key));
+
+            if (!ifs.good() || memcmp(magic, BULK_STATE_MAGIC, 8) != 0 || saved_count != count || saved_key != key)
+            {
+                return done;
+            }
+
+            done.resize((size_t)(count + 7) / 8);
+            ifs.read((char*)done.data(), done.size());
+            if ((size_t)ifs.gcount() != done.size())
+            {
+                done.clear();
+            }
+
+            ifs.close();
+
+            return done;
         }
 
-        double AllSpeed()
+        static void WriteBulkState(const std::string& statepath, uint64_t count, uint64_t key
+                , const std::vector<unsigned char>& done)
         {
-            double speed;
-            for (auto fileInfo: downloadInfo)
+            std::ofstream ofs;
+            ofs.open(statepath, std::ios::out | std::ios::binary | std::ios::trunc);
+
+            if (!ofs.is_open())
             {
-                for (auto blockInfo: fileInfo.second)
-                {
-                    speed += std::get<0>(blockInfo.second);
-                }
+                return ;
             }
 
-            return speed;
+            ofs.write(BULK_STATE_MAGIC, 8);
+            ofs.write((const char*)&count, sizeof(count));
+            ofs.write((const char*)&key, sizeof(key));
+            ofs.write((const char*)done.data(), done.size());
+
+            ofs.flush();
+            ofs.close();
         }
 
-    private:
-        std::map<std::string, std::map<long, std::tuple<double, double>>> downloadInfo;
-    };
+        static void DowdloadFinish(const std::string& filepath)
+        {
+            std::string tmp_file_path = HttpClient::FilePath2TmpPath(filepath);
+            std::rename(tmp_file_path.c_str(), filepath.c_str());
+            std::string log_file_path = HttpClient::FileLogFullPath(filepath);
+            std::remove(log_file_path.c_str());
+        }
 
-    DownloadDashboard downloadDashboard;
+        static void ClearTempAndLogFiles(const std::string& filepath)
+        {
+            std::string tmp_file_path = HttpClient::FilePath2TmpPath(filepath);
+            std::remove(tmp_file_path.c_str());
+            std::string log_file_path = HttpClient::FileLogFullPath(filepath);
+            std::remove(log_file_path.c_str());
+        }
 
-    enum class DownloadResult
+        friend class HttpClient;
+    };
+
+    /* zsync style block manifest: "FTXDELTA", version, file length, block size, then a weak and a strong sum per block */
+    struct DeltaManifest
     {
-        None,
-        Succeed,
-        Failed,
+        long length;
+        long blockSize;
+        std::vector<uint32_t> weak;
+        std::vector<uint64_t> strong;
     };
-    std::map<std::string, std::map<long, DownloadResult>> downloadResultTable;
 
-    // ==============================================
+    class DeltaTool
+    {
+    public:
+        static bool Build(const std::string& filepath, const std::string& manifest_path, long block_size)
+        {
+            MappedFile file;
+            if (block_size <= 0 || !file.Open(filepath))
+            {
+                return false;
+            }
 
-    CURLM* curlm = nullptr;
-    std::deque<CURL*> waitRequestHandles;
-    std::deque<CURL*> waitDownloadHandles;
+            std::ofstream ofs(manifest_path, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!ofs.is_open())
+            {
+                return false;
+            }
 
-    static CURL* setCurlOptEx(CURL** handle, const HttpOption& opt)
-    {
-        curl_easy_setopt(*handle, CURLOPT_VERBOSE, opt.verbose);
+            /* every integer is little-endian so a manifest built on one machine is read the same everywhere */
+            std::string header(DELTA_MANIFEST_MAGIC, 8);
+            PutLE(header, DELTA_MANIFEST_VERSION, 4);
+            PutLE(header, (uint64_t)(int64_t)file.length, 8);
+            PutLE(header, (uint32_t)block_size, 4);
+            ofs.write(header.data(), header.size());
 
-        if (!opt.userAgent.empty())
+            std::string entry;
+            for (long offset = 0; offset < file.length; offset += block_size)
+            {
+                size_t n = (size_t)std::min(block_size, file.length - offset);
+                entry.clear();
+                PutLE(entry, WeakSum(file.data + offset, n), 4);
+                PutLE(entry, StrongSum(file.data + offset, n), 8);
+                ofs.write(entry.data(), entry.size());
+            }
+
+            return ofs.good();
+        }
+
+        /* XXH64 of the whole file as 16 lowercase hex digits, empty when it cannot be read */
+        static std::string Digest(const std::string& filepath)
         {
-            curl_easy_setopt(*handle, CURLOPT_USERAGENT, opt.userAgent.c_str());
+            MappedFile file;
+            if (!file.Open(filepath))
+            {
+                return "";
+            }
+
+            char hex[17];
+            sprintf(hex, "%016llx", (unsigned long long)StrongSum(file.data, (size_t)file.length));
+            return hex;
         }
 
-        if (opt.useSSL)
+        static uint64_t Checksum(const std::string& data)
         {
-            curl_easy_setopt(*handle, CURLOPT_SSL_VERIFYPEER, opt.verifyPeer);
-            curl_easy_setopt(*handle, CURLOPT_SSL_VERIFYHOST, opt.verifyHost);
+            return StrongSum((const unsigned char*)data.data(), data.size());
+        }
 
-            if (!opt.certFile.empty())
+        static bool Parse(const std::string& data, DeltaManifest& manifest)
+        {
+            const size_t header = 8 + sizeof(uint32_t) + sizeof(int64_t) + sizeof(uint32_t);
+            if (data.size() < header || data.compare(0, 8, DELTA_MANIFEST_MAGIC, 8) != 0)
             {
-                curl_easy_setopt(*handle, CURLOPT_CAINFO, opt.certFile.c_str());
+                return false;
             }
 
-            curl_easy_setopt(*handle, CURLOPT_PIPEWAIT, opt.useHttp2);
-        }
+            uint32_t version = (uint32_t)GetLE(data.data() + 8, 4);
+            int64_t length = (int64_t)GetLE(data.data() + 12, 8);
+            uint32_t block = (uint32_t)GetLE(data.data() + 20, 4);
 
-        return *handle;
-    }
+            if (version != DELTA_MANIFEST_VERSION || length < 0 || block == 0)
+            {
+                return false;
+            }
 
-    static CURL* requestHttpHeader(const char* url, const HttpOption& opt)
-    {
-        CURL *handle = curl_easy_init ();
-        curl_easy_setopt (handle, CURLOPT_URL, url);
-        curl_easy_setopt (handle, CURLOPT_FOLLOWLOCATION, 1L);
-        curl_easy_setopt (handle, CURLOPT_AUTOREFERER, 1L);
-        curl_easy_setopt (handle, CURLOPT_HEADER, 0L);
-        curl_easy_setopt (handle, CURLOPT_NOBODY, 1L);
-        curl_easy_setopt (handle, CURLOPT_NOSIGNAL, 1L);
-        curl_easy_setopt (handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2);
+            size_t count = (size_t)((length + block - 1) / block);
+            const size_t entry = sizeof(uint32_t) + sizeof(uint64_t);
+            if (data.size() != header + count * entry)
+            {
+                return false;
+            }
 
-        setCurlOptEx(&handle, opt);
+            manifest.length = (long)length;
+            manifest.blockSize = (long)block;
+            manifest.weak.resize(count);
+            manifest.strong.resize(count);
 
-        if (curl_easy_perform (handle) != CURLE_OK)
-        {
-            return nullptr;
+            const char* p = data.data() + header;
+            for (size_t i = 0; i < count; ++i, p += entry)
+            {
+                manifest.weak[i] = (uint32_t)GetLE(p, 4);
+                manifest.strong[i] = GetLE(p + sizeof(uint32_t), 8);
+            }
+
+            return true;
         }
 
-        return handle;
-    }
+        /* writes the blocks found in basepath into tmppath and returns the ranges still to download */
+        static bool Assemble(const DeltaManifest& manifest, const std::string& basepath, const std::string& tmppath
+                , BlockList& missing)
+        {
+            size_t count = manifest.weak.size();
+            std::vector<long> found(count, -1);
 
-    static long getDownloadFileLength(const char* url, const HttpOption& opt)
-    {
-        double file_length = -1;
-        CURL* curl = requestHttpHeader(url, opt);
+            MappedFile base;
+            if (count > 0 && base.Open(basepath))
+            {
+                Match(manifest, base, found);
+            }
 
-        if (curl != nullptr)
-        {
-            curl_easy_getinfo (curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &file_length);
+            int fd = open(tmppath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+            {
+                return false;
+            }
+
+            bool ok = ftruncate(fd, manifest.length) == 0;
+            missing.all.clear();
+
+            size_t i = 0;
+            while (ok && i < count)
+            {
+                /* runs of blocks that are contiguous in both files become one copy or one range */
+                size_t j = i + 1;
+                while (j < count && (found[i] < 0) == (found[j] < 0)
+                       && (found[i] < 0 || found[j] == found[j - 1] + manifest.blockSize)
+                       && (j - i) * manifest.blockSize < DELTA_MAX_RANGE)
+                {
+                    ++j;
+                }
+
+                long begin = (long)i * manifest.blockSize;
+                long end = std::min(manifest.length, (long)j * manifest.blockSize);
+
+                if (found[i] < 0)
+                {
+                    missing.all.push_back(std::make_tuple(begin, end));
+                }
+                else
+                {
+                    ok = Copy(base, found[i], fd, begin, end - begin);
+                }
+
+                i = j;
+            }
+
+            close(fd);
+            return ok;
         }
 
-        return (long)file_length;
-    }
+    private:
+        struct MappedFile
+        {
+            const unsigned char* data = nullptr;
+            long length = 0;
+            int fd = -1;
 
-    static size_t downloadWriteData(void *ptr, size_t size, size_t nmemb, void *stream)
-    {
-        DownloadBlock* block = (DownloadBlock*)stream;
+            bool Open(const std::string& path)
+            {
+                fd = open(path.c_str(), O_RDONLY);
+                struct stat st;
+                if (fd < 0 || fstat(fd, &st) != 0)
+                {
+                    return false;
+                }
+
+                length = (long)st.st_size;
+                if (length > 0)
+                {
+                    void* mapped = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+                    if (mapped == MAP_FAILED)
+                    {
+                        return false;
+                    }
+
+                    data = (const unsigned char*)mapped;
+                    madvise(mapped, length, MADV_SEQUENTIAL);
+                }
 
-        size_t written = fwrite(ptr, size, nmemb, block->fd);
-        block->start += size * nmemb;
+                return true;
+            }
 
-        double speed;
-        double already;
-        curl_easy_getinfo(block->handle, CURLINFO_SPEED_DOWNLOAD, &speed);
-        curl_easy_getinfo(block->handle, CURLINFO_SIZE_DOWNLOAD, &already);
+            ~MappedFile()
+            {
+                if (data != nullptr)
+                {
+                    munmap((void*)data, length);
+                }
 
-        downloadDashboard.UpdateInfo(block->filepath, block->index, speed, already);
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+            }
+        };
 
-        if (block->resume)
+        /* rsync rolling checksum, the two 16 bit halves roll in O(1) per byte */
+        static uint32_t WeakSum(const unsigned char* p, size_t n)
         {
-            FileTool::UpdateBlocks(HttpClient::FileLogFullPath(block->filepath), block->index, block->start);
+            uint32_t a = 0;
+            uint32_t b = 0;
+            for (size_t i = 0; i < n; ++i)
+            {
+                a += p[i];
+                b += (uint32_t)(n - i) * p[i];
+            }
+
+            return (a & 0xffff) | (b << 16);
         }
 
-        return written;
-    }
+        static uint64_t Rotl(uint64_t x, int r)
+        {
+            return (x << r) | (x >> (64 - r));
+        }
 
-    static void pushDownload(const std::string& url, const BlockList& blockList, const std::string& filepath
-            , bool resume, const HttpOption& opt)
-    {
-        for (size_t i = 0; i < blockList.all.size(); ++i)
+        static void PutLE(std::string& out, uint64_t v, size_t bytes)
         {
-            CURL* curl = curl_easy_init();
-            long start;
-            long end;
-            char range[64];
-            auto info = blockList.all[i];
+            for (size_t i = 0; i < bytes; ++i)
+            {
+                out.push_back((char)(unsigned char)(v >> (8 * i)));
+            }
+        }
 
-            std::tie(start, end) = info;
-            sprintf(range, "%ld-%ld", start, end);
+        static uint64_t GetLE(const char* p, size_t bytes)
+        {
+            uint64_t v = 0;
+            for (size_t i = 0; i < bytes; ++i)
+            {
+                v |= (uint64_t)(unsigned char)p[i] << (8 * i);
+            }
+            return v;
+        }
 
-            DownloadBlock* block = takeDownloadBlock(curl, start, end, resume, i, filepath);
-            RequestTypeOption* reqtype = takeRequestOption(RequestType::HttpDownload, block);
+        /* XXH64 reads its input little-endian, the digests match across machines */
+        static uint64_t Read64(const unsigned char* p)
+        {
+            return GetLE((const char*)p, 8);
+        }
 
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, downloadWriteData);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, block);
-            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
-            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
-            curl_easy_setopt(curl, CURLOPT_HEADER, 0L);
-            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-            curl_easy_setopt(curl, CURLOPT_PRIVATE, reqtype);
-            curl_easy_setopt(curl, CURLOPT_RANGE, range);
-            curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2);
+        static uint64_t Read32(const unsigned char* p)
+        {
+            return GetLE((const char*)p, 4);
+        }
 
-            setCurlOptEx(&curl, opt);
+        static uint64_t Round(uint64_t acc, uint64_t input)
+        {
+            acc += input * XXH_PRIME64_2;
+            return Rotl(acc, 31) * XXH_PRIME64_1;
+        }
 
-            waitDownloadHandles.push_back(curl);
-            downloadResultTable[filepath][i] = DownloadResult::None;
+        static uint64_t Merge(uint64_t acc, uint64_t val)
+        {
+            acc ^= Round(0, val);
+            return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
         }
-    }
 
-    std::map<std::string, std::function<void(bool, std::string)>> downloadCallbackMap;
+        /* XXH64 with seed 0 */
+        static uint64_t StrongSum(const unsigned char* p, size_t n)
+        {
+            const unsigned char* end = p + n;
+            uint64_t h;
 
-    // =========================================
-    static size_t httpIndex = 0;
-    static size_t newIndex()
-    {
-        return httpIndex++;
-    }
+            if (n >= 32)
+            {
+                uint64_t v1 = XXH_PRIME64_1 + XXH_PRIME64_2;
+                uint64_t v2 = XXH_PRIME64_2;
+                uint64_t v3 = 0;
+                uint64_t v4 = 0 - XXH_PRIME64_1;
 
-    static size_t requestWriteData(void *ptr, size_t size, size_t nmemb, void *stream)
-    {
-        RequestStream* response = (RequestStream*)stream;
-        size_t length = size * nmemb;
+                for (; p + 32 <= end; p += 32)
+                {
+                    v1 = Round(v1, Read64(p));
+                    v2 = Round(v2, Read64(p + 8));
+                    v3 = Round(v3, Read64(p + 16));
+                    v4 = Round(v4, Read64(p + 24));
+                }
+
+                h = Rotl(v1, 1) + Rotl(v2, 7) + Rotl(v3, 12) + Rotl(v4, 18);
+                h = Merge(h, v1);
+                h = Merge(h, v2);
+                h = Merge(h, v3);
+                h = Merge(h, v4);
+            }
+            else
+            {
+                h = XXH_PRIME64_5;
+            }
 
-        response->stream.write((const char*)ptr, length);
+            h += n;
 
-        return length;
-    }
+            for (; p + 8 <= end; p += 8)
+            {
+                h ^= Round(0, Read64(p));
+                h = Rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+            }
 
-    std::map<size_t, std::string> postParamMap;
+            if (p + 4 <= end)
+            {
+                h ^= Read32(p) * XXH_PRIME64_1;
+                h = Rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+                p += 4;
+            }
 
-    static void pushHttpRequest(const std::string& url, size_t index, bool post, const std::string& params_str
-            , const HttpOption& opt)
-    {
-        CURL* curl = curl_easy_init();
+            for (; p < end; ++p)
+            {
+                h ^= (*p) * XXH_PRIME64_5;
+                h = Rotl(h, 11) * XXH_PRIME64_1;
+            }
 
-        RequestStream* stream = takeRequestStream(curl, index);
-        RequestTypeOption* reqtype = takeRequestOption(RequestType::HttpRequest, stream);
+            h ^= h >> 33;
+            h *= XXH_PRIME64_2;
+            h ^= h >> 29;
+            h *= XXH_PRIME64_3;
+            h ^= h >> 32;
 
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, requestWriteData);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, stream);
-        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
-        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
-        curl_easy_setopt(curl, CURLOPT_HEADER, 0L);
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_PRIVATE, reqtype);
-        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2);
+            return h;
+        }
 
-        setCurlOptEx(&curl, opt);
+        struct WeakIndex
+        {
+            std::vector<std::pair<uint32_t, size_t>> sorted;
+            std::vector<bool> filter;
+            uint32_t mask;
+        };
 
-        if (post)
+        /* every thread rolls over its own slice of the base file, a match skips a whole block ahead */
+        static void Match(const DeltaManifest& manifest, const MappedFile& base, std::vector<long>& found)
         {
-            curl_easy_setopt(curl, CURLOPT_POST, 1L);
-            if (!params_str.empty())
+            size_t count = manifest.weak.size();
+            long block_size = manifest.blockSize;
+            size_t full = manifest.length % block_size == 0 ? count : count - 1;
+
+            WeakIndex index;
+            uint32_t bits = 1024;
+            while (bits < full * 16 && bits < (1u << 30))
             {
-                postParamMap[index] = params_str;
-                curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postParamMap[index].c_str());
+                bits <<= 1;
             }
-        }
+            index.mask = bits - 1;
+            index.filter.assign(bits, false);
+            for (size_t i = 0; i < full; ++i)
+            {
+                index.sorted.push_back(std::make_pair(manifest.weak[i], i));
+                index.filter[Mix(manifest.weak[i]) & index.mask] = true;
+            }
+            std::sort(index.sorted.begin(), index.sorted.end());
 
-        waitRequestHandles.push_back(curl);
-    }
+            long positions = base.length - block_size + 1;
+            std::vector<std::vector<std::pair<size_t, long>>> results;
 
-    std::map<size_t, std::function<void(long, std::string)>> httpResponseMap;
+            if (positions > 0 && full > 0)
+            {
+                long workers = std::max(1L, std::min((long)std::thread::hardware_concurrency()
+                        , positions / (block_size * DELTA_MIN_BLOCKS_PER_THREAD) + 1));
+                long slice = (positions + workers - 1) / workers;
+                results.resize(workers);
 
-    // =========================================
-    static HttpOption defaultHttpOption(const std::string& url)
-    {
-        HttpOption opt;
+                std::vector<std::thread> threads;
+                for (long w = 0; w < workers; ++w)
+                {
+                    long begin = w * slice;
+                    long end = std::min(positions, begin + slice);
+                    auto& result = results[w];
+                    threads.push_back(std::thread([&manifest, &base, &index, &result, begin, end](){
+                        Scan(manifest, base, index, begin, end, result);
+                    }));
+                }
+
+                for (auto& t: threads)
+                {
+                    t.join();
+                }
+            }
+
+            for (auto& result: results)
+            {
+                for (auto& item: result)
+                {
+                    if (found[item.first] < 0)
+                    {
+                        found[item.first] = item.second;
+                    }
+                }
+            }
+
+            /* a short last block only lines up with the same offset or the end of the base file */
+            if (full < count)
+            {
+                long last = manifest.length - (long)full * block_size;
+                long candidates[2] = {(long)full * block_size, base.length - last};
+                for (long offset: candidates)
+                {
+                    if (found[full] < 0 && offset >= 0 && offset + last <= base.length
+                        && WeakSum(base.data + offset, last) == manifest.weak[full]
+                        && StrongSum(base.data + offset, last) == manifest.strong[full])
+                    {
+                        found[full] = offset;
+                    }
+                }
+            }
+        }
+
+        static uint32_t Mix(uint32_t weak)
+        {
+            return (weak ^ (weak >> 15)) * 0x2c1b3c6dU;
+        }
+
+        static void Scan(const DeltaManifest& manifest, const MappedFile& base, const WeakIndex& index
+                , long begin, long end, std::vector<std::pair<size_t, long>>& result)
+        {
+            const unsigned char* data = base.data;
+            uint32_t n = (uint32_t)manifest.blockSize;
+            uint32_t a = 0;
+            uint32_t b = 0;
+            bool fresh = true;
+
+            long p = begin;
+            while (p < end)
+            {
+                if (fresh)
+                {
+                    uint32_t weak = WeakSum(data + p, n);
+                    a = weak & 0xffff;
+                    b = weak >> 16;
+                    fresh = false;
+                }
+
+                uint32_t weak = (a & 0xffff) | (b << 16);
+                if (index.filter[Mix(weak) & index.mask] && Lookup(manifest, index, data + p, weak, p, result))
+                {
+                    p += n;
+                    fresh = true;
+                    continue;
+                }
+
+                if (p + (long)n >= base.length)
+                {
+                    break;
+                }
+
+                unsigned char out = data[p];
+                unsigned char in = data[p + n];
+                a = a - out + in;
+                b = b - n * out + a;
+                ++p;
+            }
+        }
+
+        static bool Lookup(const DeltaManifest& manifest, const WeakIndex& index, const unsigned char* p, uint32_t weak
+                , long offset, std::vector<std::pair<size_t, long>>& result)
+        {
+            auto range = std::equal_range(index.sorted.begin(), index.sorted.end(), std::make_pair(weak, (size_t)0)
+                    , [](const std::pair<uint32_t, size_t>& l, const std::pair<uint32_t, size_t>& r){
+                        return l.first < r.first;
+                    });
+
+            if (range.first == range.second)
+            {
+                return false;
+            }
+
+            uint64_t strong = StrongSum(p, (size_t)manifest.blockSize);
+            bool matched = false;
+            for (auto iter = range.first; iter != range.second; ++iter)
+            {
+                if (manifest.strong[iter->second] == strong)
+                {
+                    result.push_back(std::make_pair(iter->second, offset));
+                    matched = true;
+                }
+            }
+
+            return matched;
+        }
+
+        static bool Copy(const MappedFile& base, long from, int fd, long to, long length)
+        {
+            loff_t in = from;
+            loff_t out = to;
+            long left = length;
+            while (left > 0)
+            {
+                ssize_t ret = copy_file_range(base.fd, &in, fd, &out, (size_t)left, 0);
+                if (ret < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+
+                if (ret <= 0)
+                {
+                    break;
+                }
+
+                left -= ret;
+            }
+
+            /* copy_file_range is not supported everywhere, the mapping is always there */
+            while (left > 0)
+            {
+                ssize_t ret = pwrite(fd, base.data + in, (size_t)left, out);
+                if (ret < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+
+                if (ret <= 0)
+                {
+                    return false;
+                }
+
+                in += ret;
+                out += ret;
+                left -= ret;
+            }
+
+            return true;
+        }
+    };
+
+    struct QueuedDownload
+    {
+        size_t id;
+        std::string url;
+        std::string filepath;
+        size_t blockSize;
+    };
+
+    /* append only: per record a payload length, the low half of its XXH64 and the payload, 'Q' for a queued file
+     * and 'D' for one that is finished or cancelled; a torn last record fails its checksum and ends the replay */
+    class DownloadQueueLog
+    {
+    public:
+        ~DownloadQueueLog()
+        {
+            Close();
+        }
+
+        /* replays the log, then rewrites it with only the pending files */
+        bool Open(const std::string& dir, std::vector<QueuedDownload>& pending)
+        {
+            path = dir + DOWNLOAD_QUEUE_FILE;
+            pending.clear();
+
+            std::ifstream ifs(path, std::ios::in | std::ios::binary);
+            uint32_t header[2];
+            std::string payload;
+            while (ifs.read((char*)header, sizeof(header)) && header[0] <= DOWNLOAD_QUEUE_MAX_RECORD)
+            {
+                payload.resize(header[0]);
+                if (!ifs.read(&payload[0], header[0]) || (uint32_t)DeltaTool::Checksum(payload) != header[1])
+                {
+                    break;
+                }
+
+                QueuedDownload entry;
+                if (!Decode(payload, entry))
+                {
+                    break;
+                }
+
+                auto same = [&entry](const QueuedDownload& item){ return item.filepath == entry.filepath; };
+                pending.erase(std::remove_if(pending.begin(), pending.end(), same), pending.end());
+                if (payload[0] == 'Q')
+                {
+                    pending.push_back(entry);
+                }
+            }
+            ifs.close();
+
+            std::string tmppath = path + TEMP_FILE_SUFFIX;
+            fd = open(tmppath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+            {
+                return false;
+            }
+
+            for (auto& entry: pending)
+            {
+                Queued(entry);
+            }
+
+            if (!Sync() || std::rename(tmppath.c_str(), path.c_str()) != 0)
+            {
+                Close();
+                return false;
+            }
+
+            int dirfd = open(dir.c_str(), O_RDONLY);
+            if (dirfd >= 0)
+            {
+                fsync(dirfd);
+                close(dirfd);
+            }
+
+            return true;
+        }
+
+        void Queued(const QueuedDownload& entry)
+        {
+            uint32_t block_size = (uint32_t)entry.blockSize;
+            std::string payload(1, 'Q');
+            payload.append((const char*)&block_size, sizeof(block_size));
+            AppendString(payload, entry.url);
+            AppendString(payload, entry.filepath);
+            Append(payload);
+        }
+
+        void Done(const std::string& filepath)
+        {
+            std::string payload(1, 'D');
+            AppendString(payload, filepath);
+            Append(payload);
+        }
+
+        /* one write and one fdatasync for every record since the last call */
+        bool Sync()
+        {
+            if (fd < 0 || buffer.empty())
+            {
+                return true;
+            }
+
+            size_t done = 0;
+            while (done < buffer.size())
+            {
+                ssize_t ret = write(fd, buffer.data() + done, buffer.size() - done);
+                if (ret < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+
+                if (ret <= 0)
+                {
+                    /* what reached the file stays there, the next call continues after it */
+                    fprintf(stderr, "E: download queue %s: %s\n", path.c_str(), strerror(errno));
+                    buffer.erase(0, done);
+                    return false;
+                }
+
+                done += ret;
+            }
+
+            buffer.clear();
+            return fdatasync(fd) == 0;
+        }
+
+        void Close()
+        {
+            if (fd >= 0)
+            {
+                Sync();
+                close(fd);
+                fd = -1;
+            }
+        }
+
+        bool IsOpen() const
+        {
+            return fd >= 0;
+        }
+
+    private:
+        static void AppendString(std::string& payload, const std::string& value)
+        {
+            uint32_t size = (uint32_t)value.size();
+            payload.append((const char*)&size, sizeof(size));
+            payload.append(value);
+        }
+
+        static bool ReadString(const std::string& payload, size_t& pos, std::string& value)
+        {
+            uint32_t size;
+            if (pos + sizeof(size) > payload.size())
+            {
+                return false;
+            }
+
+            memcpy(&size, payload.data() + pos, sizeof(size));
+            pos += sizeof(size);
+            if (pos + size > payload.size())
+            {
+                return false;
+            }
+
+            value.assign(payload, pos, size);
+            pos += size;
+            return true;
+        }
+
+        static bool Decode(const std::string& payload, QueuedDownload& entry)
+        {
+            size_t pos = 1;
+            if (payload.empty())
+            {
+                return false;
+            }
+
+            if (payload[0] == 'D')
+            {
+                return ReadString(payload, pos, entry.filepath);
+            }
+
+            uint32_t block_size;
+            if (payload[0] != 'Q' || pos + sizeof(block_size) > payload.size())
+            {
+                return false;
+            }
+
+            memcpy(&block_size, payload.data() + pos, sizeof(block_size));
+            pos += sizeof(block_size);
+            entry.blockSize = block_size;
+
+            return ReadString(payload, pos, entry.url) && ReadString(payload, pos, entry.filepath);
+        }
+
+        void Append(const std::string& payload)
+        {
+            if (fd < 0)
+            {
+                return ;
+            }
+
+            uint32_t header[2] = {(uint32_t)payload.size(), (uint32_t)DeltaTool::Checksum(payload)};
+            buffer.append((const char*)header, sizeof(header));
+            buffer.append(payload);
+        }
+
+        std::string path;
+        std::string buffer;
+        int fd = -1;
+    };
+
+    class WriteBufferPool
+    {
+    public:
+        void Init(size_t buffer_size, size_t buffer_count)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            bufferSize = buffer_size;
+            bufferCount = buffer_count;
+        }
+
+        /* nullptr when every buffer is in use */
+        char* Take()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (!idle.empty())
+            {
+                char* buffer = idle.back();
+                idle.pop_back();
+                return buffer;
+            }
+
+            if (allocated >= bufferCount)
+            {
+                return nullptr;
+            }
+
+            void* buffer = nullptr;
+            if (posix_memalign(&buffer, WRITE_BUFFER_ALIGNMENT, bufferSize) != 0)
+            {
+                return nullptr;
+            }
+
+            ++allocated;
+            return (char*)buffer;
+        }
+
+        void Putback(char* buffer)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            idle.push_back(buffer);
+        }
+
+        bool Available()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            return !idle.empty() || allocated < bufferCount;
+        }
+
+        size_t BufferSize()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            return bufferSize;
+        }
+
+        void Clear()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            for (auto buffer: idle)
+            {
+                free(buffer);
+            }
+
+            allocated -= idle.size();
+            idle.clear();
+        }
+
+    private:
+        std::mutex mtx;
+        std::vector<char*> idle;
+        size_t allocated = 0;
+        size_t bufferSize = 1024 * 1024;
+        size_t bufferCount = 64;
+    };
+
+#if defined(FTX_USE_IO_URING)
+    class IoUring
+    {
+    public:
+        bool Init(unsigned entries)
+        {
+            io_uring_params params;
+            memset(&params, 0, sizeof(params));
+
+            fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+            if (fd < 0)
+            {
+                return false;
+            }
+
+            sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (singleMmap)
+            {
+                sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+            }
+
+            sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            cqRing = singleMmap ? sqRing
+                    : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+            sqes = (io_uring_sqe*) mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+            if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED)
+            {
+                Destroy();
+                return false;
+            }
+
+            char* sq = (char*) sqRing;
+            sqTail = (unsigned*)(sq + params.sq_off.tail);
+            sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+            sqArray = (unsigned*)(sq + params.sq_off.array);
+
+            char* cq = (char*) cqRing;
+            cqHead = (unsigned*)(cq + params.cq_off.head);
+            cqTail = (unsigned*)(cq + params.cq_off.tail);
+            cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+            cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+            capacity = params.sq_entries;
+
+            return true;
+        }
+
+        void Destroy()
+        {
+            if (sqes != nullptr && sqes != MAP_FAILED)
+            {
+                munmap(sqes, sqesSize);
+            }
+            if (cqRing != nullptr && cqRing != MAP_FAILED && !singleMmap)
+            {
+                munmap(cqRing, cqRingSize);
+            }
+            if (sqRing != nullptr && sqRing != MAP_FAILED)
+            {
+                munmap(sqRing, sqRingSize);
+            }
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+
+            sqRing = cqRing = nullptr;
+            sqes = nullptr;
+            fd = -1;
+        }
+
+        bool Ready() const
+        {
+            return fd >= 0;
+        }
+
+        bool Full() const
+        {
+            return inflight >= capacity;
+        }
+
+        unsigned Inflight() const
+        {
+            return inflight;
+        }
+
+        void PrepareWrite(int file, const char* data, unsigned length, long offset, uint64_t user_data)
+        {
+            unsigned tail = *sqTail;
+            unsigned index = tail & sqMask;
+
+            io_uring_sqe* sqe = &sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = file;
+            sqe->addr = (uint64_t)(uintptr_t)data;
+            sqe->len = length;
+            sqe->off = (uint64_t)offset;
+            sqe->user_data = user_data;
+
+            sqArray[index] = index;
+            __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+            ++unsubmitted;
+            ++inflight;
+        }
+
+        bool Submit(unsigned wait_completions)
+        {
+            int ret = (int)syscall(__NR_io_uring_enter, fd, unsubmitted, wait_completions
+                    , wait_completions > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (ret < 0)
+            {
+                return errno == EINTR || errno == EAGAIN || errno == EBUSY;
+            }
+
+            unsubmitted -= std::min(unsubmitted, (unsigned)ret);
+            return true;
+        }
+
+        bool Reap(uint64_t& user_data, int& result)
+        {
+            unsigned head = *cqHead;
+            if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+            {
+                return false;
+            }
+
+            io_uring_cqe* cqe = &cqes[head & cqMask];
+            user_data = cqe->user_data;
+            result = cqe->res;
+
+            __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+            --inflight;
+
+            return true;
+        }
+
+    private:
+        int fd = -1;
+        bool singleMmap = false;
+        void* sqRing = nullptr;
+        void* cqRing = nullptr;
+        io_uring_sqe* sqes = nullptr;
+        size_t sqRingSize = 0;
+        size_t cqRingSize = 0;
+        size_t sqesSize = 0;
+        unsigned* sqTail = nullptr;
+        unsigned sqMask = 0;
+        unsigned* sqArray = nullptr;
+        unsigned* cqHead = nullptr;
+        unsigned* cqTail = nullptr;
+        unsigned cqMask = 0;
+        io_uring_cqe* cqes = nullptr;
+        unsigned capacity = 0;
+        unsigned inflight = 0;
+        unsigned unsubmitted = 0;
+    };
+#endif
+
+    struct WriteJob
+    {
+        std::shared_ptr<BlockSink> sink;
+        char* buffer;   /* nullptr closes the sink */
+        size_t length;
+        size_t done;
+        long offset;
+        bool pooled;
+    };
+
+    /* writes download buffers off the curl thread, through io_uring when available, pwrite otherwise */
+    class DiskWriter
+    {
+    public:
+        DiskWriter(HttpTaskManager& tasks, WriteBufferPool& buffers)
+        : tasks(tasks), buffers(buffers)
+        {
+
+        }
+
+        void Start()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (running)
+            {
+                return ;
+            }
+
+            running = true;
+#if defined(FTX_USE_IO_URING)
+            ring.Init(IO_URING_ENTRIES);
+#endif
+            worker = std::thread([this](){ Run(); });
+        }
+
+        /* drains the queue before returning */
+        void Stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (!running)
+                {
+                    return ;
+                }
+
+                running = false;
+            }
+
+            cv.notify_one();
+            worker.join();
+
+#if defined(FTX_USE_IO_URING)
+            ring.Destroy();
+#endif
+        }
+
+        void Submit(const WriteJob& job)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                jobs.push_back(job);
+            }
+
+            cv.notify_one();
+        }
+
+    private:
+        void Run()
+        {
+            while (true)
+            {
+                std::deque<WriteJob> batch;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    if (Idle())
+                    {
+                        cv.wait(lock, [this](){ return !jobs.empty() || !running; });
+                    }
+
+                    if (!running && jobs.empty() && Idle())
+                    {
+                        break;
+                    }
+
+                    batch.swap(jobs);
+                }
+
+                for (auto& job: batch)
+                {
+                    Dispatch(job);
+                }
+
+                Pump();
+            }
+        }
+
+        bool Idle() const
+        {
+#if defined(FTX_USE_IO_URING)
+            return deferred.empty() && ring.Inflight() == 0;
+#else
+            return true;
+#endif
+        }
+
+        void Dispatch(WriteJob& job)
+        {
+            if (job.buffer == nullptr)
+            {
+                job.sink->closed = true;
+                TryFinish(job.sink);
+                return ;
+            }
+
+            ++job.sink->pending;
+
+#if defined(FTX_USE_IO_URING)
+            if (ring.Ready())
+            {
+                deferred.push_back(job);
+                return ;
+            }
+#endif
+
+            WriteSync(job);
+        }
+
+        void WriteSync(WriteJob& job)
+        {
+            bool ok = !job.sink->failed;
+            while (ok && job.done < job.length)
+            {
+                ssize_t ret = pwrite(job.sink->fd, job.buffer + job.done, job.length - job.done, job.offset + job.done);
+                if (ret < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+
+                ok = ret > 0;
+                job.done += ok ? ret : 0;
+            }
+
+            Complete(job, ok);
+        }
+
+        void Pump()
+        {
+#if defined(FTX_USE_IO_URING)
+            if (!ring.Ready())
+            {
+                return ;
+            }
+
+            while (!deferred.empty() && !ring.Full())
+            {
+                WriteJob& job = deferred.front();
+                if (job.sink->failed)
+                {
+                    Complete(job, false);
+                }
+                else
+                {
+                    uint64_t id = ++lastId;
+                    ring.PrepareWrite(job.sink->fd, job.buffer + job.done, (unsigned)(job.length - job.done)
+                            , job.offset + job.done, id);
+                    inflight[id] = job;
+                }
+                deferred.pop_front();
+            }
+
+            if (ring.Inflight() == 0)
+            {
+                return ;
+            }
+
+            if (!ring.Submit(1))
+            {
+                /* the ring is unusable, finish everything synchronously */
+                uint64_t id;
+                int result;
+                while (ring.Reap(id, result))
+                {
+                    inflight.erase(id);
+                }
+                for (auto& item: inflight)
+                {
+                    deferred.push_back(item.second);
+                }
+                inflight.clear();
+                ring.Destroy();
+
+                for (auto& job: deferred)
+                {
+                    WriteSync(job);
+                }
+                deferred.clear();
+                return ;
+            }
+
+            uint64_t id;
+            int result;
+            while (ring.Reap(id, result))
+            {
+                WriteJob job = inflight[id];
+                inflight.erase(id);
+
+                if (result == -EINVAL || result == -EOPNOTSUPP)
+                {
+                    WriteSync(job);
+                }
+                else if (result > 0 && job.done + result < job.length)
+                {
+                    job.done += result;
+                    deferred.push_front(job);
+                }
+                else
+                {
+                    job.done += result > 0 ? result : 0;
+                    Complete(job, result > 0 || job.length == 0);
+                }
+            }
+#endif
+        }
+
+        void Complete(WriteJob& job, bool ok)
+        {
+            if (job.pooled)
+            {
+                buffers.Putback(job.buffer);
+            }
+            else
+            {
+                free(job.buffer);
+            }
+
+            BlockSink* sink = job.sink.get();
+            if (!ok)
+            {
+                sink->failed = true;
+            }
+            else
+            {
+                Commit(sink, job.offset, job.offset + (long)job.length);
+            }
+
+            --sink->pending;
+            TryFinish(job.sink);
+        }
+
+        /* the journal only moves over bytes that are on disk, out of order writes wait for the gap */
+        void Commit(BlockSink* sink, long begin, long end)
+        {
+            if (begin != sink->committed)
+            {
+                sink->written[begin] = end;
+                return ;
+            }
+
+            sink->committed = end;
+            auto iter = sink->written.find(sink->committed);
+            while (iter != sink->written.end())
+            {
+                sink->committed = iter->second;
+                sink->written.erase(iter);
+                iter = sink->written.find(sink->committed);
+            }
+
+            if (sink->resume)
+            {
+                FileTool::UpdateBlocks(sink->logfile, sink->index, sink->committed);
+            }
+        }
+
+        void TryFinish(std::shared_ptr<BlockSink>& sink)
+        {
+            if (!sink->closed || sink->pending > 0)
+            {
+                return ;
+            }
+
+            if (sink->fd >= 0)
+            {
+                close(sink->fd);
+                sink->fd = -1;
+            }
+
+            bool ok = !sink->failed;
+            auto flushed = sink->flushed;
+            if (flushed != nullptr)
+            {
+                tasks.PushToBackgroundThread([flushed, ok](){
+                    flushed(ok);
+                });
+            }
+        }
+
+        HttpTaskManager& tasks;
+        WriteBufferPool& buffers;
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::deque<WriteJob> jobs;
+        std::thread worker;
+        bool running = false;
+
+#if defined(FTX_USE_IO_URING)
+        IoUring ring;
+        std::deque<WriteJob> deferred;
+        std::map<uint64_t, WriteJob> inflight;
+        uint64_t lastId = 0;
+#endif
+    };
+
+    /* one thread for the cpu-bound work of the engine: delta matching and digest checks, one file at a time */
+    class HashWorker
+    {
+    public:
+        void Start()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (running)
+            {
+                return ;
+            }
+
+            running = true;
+            worker = std::thread([this](){ Run(); });
+        }
+
+        /* queued jobs are dropped, only the running one is waited for */
+        void Stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (!running)
+                {
+                    return ;
+                }
+
+                running = false;
+                jobs.clear();
+            }
+
+            cv.notify_one();
+            worker.join();
+        }
+
+        void Post(const std::string& key, std::function<void()> job)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (!running)
+                {
+                    return ;
+                }
+
+                jobs.push_back(std::make_pair(key, job));
+            }
+
+            cv.notify_one();
+        }
+
+        /* forgets the jobs of a cancelled file that have not started yet */
+        void Drop(const std::string& key)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            for (auto iter = jobs.begin(); iter != jobs.end();)
+            {
+                iter = iter->first == key ? jobs.erase(iter) : iter + 1;
+            }
+        }
+
+    private:
+        void Run()
+        {
+            while (true)
+            {
+                std::function<void()> job;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cv.wait(lock, [this](){ return !jobs.empty() || !running; });
+                    if (!running)
+                    {
+                        break;
+                    }
+
+                    job = jobs.front().second;
+                    jobs.pop_front();
+                }
+
+                job();
+            }
+        }
+
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::deque<std::pair<std::string, std::function<void()>>> jobs;
+        std::thread worker;
+        bool running = false;
+    };
+
+    /* coalesces the small writes of libcurl into pooled buffers for the disk writer */
+    class DownloadSink
+    {
+    public:
+        DownloadSink(DiskWriter& writer, WriteBufferPool& buffers)
+        : writer(writer), buffers(buffers)
+        {
+
+        }
+
+        /* false means the caller should pause the handle until a buffer is free */
+        bool Reserve(DownloadBlock* block, size_t length)
+        {
+            size_t buffer_size = buffers.BufferSize();
+            if (block->buffer != nullptr && block->buffered + length <= buffer_size)
+            {
+                return true;
+            }
+
+            Flush(block);
+
+            if (length > buffer_size)
+            {
+                return true;
+            }
+
+            block->buffer = buffers.Take();
+            if (block->buffer == nullptr)
+            {
+                waiting.push_back(block->handle);
+                return false;
+            }
+
+            block->buffered = 0;
+            block->bufferStart = block->start;
+
+            return true;
+        }
+
+        void Append(DownloadBlock* block, const char* data, size_t length)
+        {
+            if (block->buffer == nullptr)
+            {
+                char* copy = (char*) malloc(length);
+                memcpy(copy, data, length);
+                writer.Submit(WriteJob{block->sink, copy, length, 0, block->start, false});
+                return ;
+            }
+
+            memcpy(block->buffer + block->buffered, data, length);
+            block->buffered += length;
+
+            if (block->buffered == buffers.BufferSize())
+            {
+                Flush(block);
+            }
+        }
+
+        void Flush(DownloadBlock* block)
+        {
+            if (block->buffer == nullptr)
+            {
+                return ;
+            }
+
+            if (block->buffered > 0)
+            {
+                writer.Submit(WriteJob{block->sink, block->buffer, block->buffered, 0, block->bufferStart, true});
+            }
+            else
+            {
+                buffers.Putback(block->buffer);
+            }
+
+            block->buffer = nullptr;
+            block->buffered = 0;
+        }
+
+        /* flushed(ok) runs on the http thread once every byte of the block is written */
+        void Finish(DownloadBlock* block, std::function<void(bool)> flushed)
+        {
+            Flush(block);
+
+            block->sink->flushed = flushed;
+            writer.Submit(WriteJob{block->sink, nullptr, 0, 0, 0, false});
+        }
+
+        void ResumeWaiting()
+        {
+            if (waiting.empty() || !buffers.Available())
+            {
+                return ;
+            }
+
+            std::vector<CURL*> temp;
+            temp.swap(waiting);
+
+            for (auto handle: temp)
+            {
+                curl_easy_pause(handle, CURLPAUSE_CONT);
+            }
+        }
+
+        void Forget(CURL* handle)
+        {
+            waiting.erase(std::remove(waiting.begin(), waiting.end(), handle), waiting.end());
+        }
+
+        bool HasWaiting() const
+        {
+            return !waiting.empty();
+        }
+
+    private:
+        DiskWriter& writer;
+        WriteBufferPool& buffers;
+        std::vector<CURL*> waiting;
+    };
+
+    class DownloadDashboard
+    {
+    public:
+        void UpdateInfo(const std::string& filepath, size_t index, double speed, double size)
+        {
+            downloadInfo[filepath][index] = std::make_tuple(speed, size);
+        }
+
+        void Remove(const std::string& filepath)
+        {
+            downloadInfo.erase(filepath);
+        }
+
+        std::tuple<double, double> SpeedAndSize(const std::string& filepath)
+        {
+            auto curr_file = downloadInfo[filepath];
+            double speed = 0;
+            double size = 0;
+            for (auto info: curr_file)
+            {
+                speed += std::get<0>(info.second);
+                size += std::get<1>(info.second);
+            }
+
+            return std::make_tuple(speed, size);
+        };
+
+        double Speed(const std::string& filepath)
+        {
+            auto curr_file = downloadInfo[filepath];
+            double speed = 0;
+            for (auto info: curr_file)
+            {
+                speed += std::get<0>(info.second);
+            }
+
+            return speed;
+        }
+
+        double Size(const std::string& filepath)
+        {
+            auto curr_file = downloadInfo[filepath];
+            double size = 0;
+            for (auto info: curr_file)
+            {
+                size += std::get<1>(info.second);
+            }
+
+            return size;
+        }
+
+        double AllSpeed()
+        {
+            double speed;
+            for (auto fileInfo: downloadInfo)
+            {
+                for (auto blockInfo: fileInfo.second)
+                {
+                    speed += std::get<0>(blockInfo.second);
+                }
+            }
+
+            return speed;
+        }
+
+    private:
+        std::map<std::string, std::map<long, std::tuple<double, double>>> downloadInfo;
+    };
+
+    // ==============================================
+
+    class TokenBucket
+    {
+    public:
+        TokenBucket()
+        : rate(0), tokens(0), last(std::chrono::steady_clock::now())
+        {
+
+        }
+
+        void SetRate(long long bytes_per_sec)
+        {
+            rate = bytes_per_sec;
+            tokens = std::min(tokens, (double)Burst());
+        }
+
+        bool Unlimited() const
+        {
+            return rate <= 0;
+        }
+
+        bool Available() const
+        {
+            return Unlimited() || tokens > 0;
+        }
+
+        void Refill(std::chrono::steady_clock::time_point now)
+        {
+            double elapsed = std::chrono::duration<double>(now - last).count();
+            last = now;
+
+            if (!Unlimited())
+            {
+                tokens = std::min(tokens + elapsed * rate, (double)Burst());
+            }
+        }
+
+        void Consume(size_t length)
+        {
+            if (!Unlimited())
+            {
+                tokens -= length;
+            }
+        }
+
+    private:
+        long long Burst() const
+        {
+            return std::max(rate / 10, MIN_BUCKET_BURST);
+        }
+
+        long long rate;
+        double tokens;
+        std::chrono::steady_clock::time_point last;
+    };
+
+    /* global -> host -> transfer, a transfer is paused until every level has tokens again */
+    class BandwidthShaper
+    {
+    public:
+        void SetGlobalLimit(long long bytes_per_sec)
+        {
+            global.SetRate(bytes_per_sec);
+        }
+
+        void SetHostLimit(const std::string& host, long long bytes_per_sec)
+        {
+            hosts[host].SetRate(bytes_per_sec);
+        }
+
+        void SetTransferLimit(const std::string& key, long long bytes_per_sec)
+        {
+            transfers[key].SetRate(bytes_per_sec);
+        }
+
+        void RemoveTransfer(const std::string& key)
+        {
+            transfers.erase(key);
+        }
+
+        /* false means the caller should pause the handle, it is resumed by Resume() */
+        bool Acquire(CURL* handle, const std::string& host, const std::string& key, size_t length)
+        {
+            TokenBucket* host_bucket = Find(hosts, host);
+            TokenBucket* transfer_bucket = Find(transfers, key);
+
+            if (!global.Available()
+                || (host_bucket != nullptr && !host_bucket->Available())
+                || (transfer_bucket != nullptr && !transfer_bucket->Available()))
+            {
+                paused.push_back(std::make_tuple(handle, host, key));
+                return false;
+            }
+
+            Consume(host, key, length);
+
+            return true;
+        }
+
+        /* latency sensitive traffic is never paused, it only takes its share from the budget */
+        void Consume(const std::string& host, const std::string& key, size_t length)
+        {
+            TokenBucket* host_bucket = Find(hosts, host);
+            TokenBucket* transfer_bucket = Find(transfers, key);
+
+            global.Consume(length);
+            if (host_bucket != nullptr)
+            {
+                host_bucket->Consume(length);
+            }
+            if (transfer_bucket != nullptr)
+            {
+                transfer_bucket->Consume(length);
+            }
+        }
+
+        void Resume()
+        {
+            auto now = std::chrono::steady_clock::now();
+            global.Refill(now);
+            for (auto& bucket: hosts)
+            {
+                bucket.second.Refill(now);
+            }
+            for (auto& bucket: transfers)
+            {
+                bucket.second.Refill(now);
+            }
+
+            if (paused.empty())
+            {
+                return ;
+            }
+
+            std::vector<std::tuple<CURL*, std::string, std::string>> temp;
+            temp.swap(paused);
+
+            for (auto item: temp)
+            {
+                TokenBucket* host_bucket = Find(hosts, std::get<1>(item));
+                TokenBucket* transfer_bucket = Find(transfers, std::get<2>(item));
+
+                if (global.Available()
+                    && (host_bucket == nullptr || host_bucket->Available())
+                    && (transfer_bucket == nullptr || transfer_bucket->Available()))
+                {
+                    curl_easy_pause(std::get<0>(item), CURLPAUSE_CONT);
+                }
+                else
+                {
+                    paused.push_back(item);
+                }
+            }
+        }
+
+        void Forget(CURL* handle)
+        {
+            for (auto iter = paused.begin(); iter != paused.end();)
+            {
+                if (std::get<0>(*iter) == handle)
+                {
+                    iter = paused.erase(iter);
+                }
+                else
+                {
+                    ++iter;
+                }
+            }
+        }
+
+        bool HasPaused() const
+        {
+            return !paused.empty();
+        }
+
+    private:
+        static TokenBucket* Find(std::map<std::string, TokenBucket>& buckets, const std::string& key)
+        {
+            auto iter = buckets.find(key);
+            if (iter == buckets.end() || iter->second.Unlimited())
+            {
+                return nullptr;
+            }
+
+            return &iter->second;
+        }
+
+        TokenBucket global;
+        std::map<std::string, TokenBucket> hosts;
+        std::map<std::string, TokenBucket> transfers;
+        std::vector<std::tuple<CURL*, std::string, std::string>> paused;
+    };
+
+    enum class DownloadResult
+    {
+        None,
+        Succeed,
+        Failed,
+    };
+    static std::string urlHost(const std::string& url)
+    {
+        size_t begin = url.find("://");
+        begin = begin == std::string::npos ? 0 : begin + 3;
+
+        size_t end = url.find_first_of("/?#", begin);
+        std::string authority = url.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+
+        size_t at = authority.rfind('@');
+        if (at != std::string::npos)
+        {
+            authority = authority.substr(at + 1);
+        }
+
+        if (!authority.empty() && authority[0] == '[')
+        {
+            authority = authority.substr(0, authority.find(']') + 1);
+        }
+        else
+        {
+            authority = authority.substr(0, authority.find(':'));
+        }
+
+        for (auto& c: authority)
+        {
+            c = (char)tolower(c);
+        }
+
+        return authority;
+    }
+
+    static long curlHttpVersion(HttpVersion version)
+    {
+        switch (version)
+        {
+            case HttpVersion::Http1_1:
+                return CURL_HTTP_VERSION_1_1;
+            case HttpVersion::Http2:
+                return CURL_HTTP_VERSION_2TLS;
+            case HttpVersion::Http2PriorKnowledge:
+                return CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE;
+            default:
+                return CURL_HTTP_VERSION_2;
+        }
+    }
+
+    struct MirrorState
+    {
+        std::string url;
+        std::string host;
+        double throughput;
+        size_t samples;
+        long inflight;
+        int failures;
+    };
+
+    struct DownloadTask
+    {
+        size_t id;
+        std::vector<MirrorState> mirrors;
+        HttpOption opt;
+        bool resume;
+        int retriesLeft;
+        std::map<size_t, int> attempts;
+    };
+
+    /* picks the mirror with the most throughput per block in flight, unmeasured mirrors first */
+    static size_t chooseMirror(DownloadTask& task)
+    {
+        size_t best = 0;
+        double best_score = -1;
+        bool all_failing = true;
+
+        for (auto& mirror: task.mirrors)
+        {
+            all_failing = all_failing && mirror.failures >= MIRROR_MAX_FAILURES;
+        }
+
+        for (size_t i = 0; i < task.mirrors.size(); ++i)
+        {
+            MirrorState& mirror = task.mirrors[i];
+            if (!all_failing && mirror.failures >= MIRROR_MAX_FAILURES)
+            {
+                continue;
+            }
+
+            double score = mirror.samples == 0 ? 1e18 / (mirror.inflight + 1) : mirror.throughput / (mirror.inflight + 1);
+            if (score > best_score)
+            {
+                best = i;
+                best_score = score;
+            }
+        }
+
+        return best;
+    }
+
+    // =========================================
+    struct BulkTask
+    {
+        std::vector<BulkItem> items;
+        HttpOption opt;
+        std::string statepath;
+        int statefd;
+        std::vector<unsigned char> done;
+        std::deque<size_t> queue;
+        std::map<size_t, int> attempts;
+        std::vector<std::string> failed;
+        size_t remaining;
+    };
+
+    struct UploadTask
+    {
+        size_t id;
+        int fd;
+        void* data;
+        size_t length;
+        bool resume;
+        UploadOption upload;
+        HttpOption opt;
+        size_t blockSize;
+        int retriesLeft;
+        std::map<size_t, int> attempts;
+        std::map<size_t, DownloadResult> results;
+        std::map<size_t, std::string> tags;
+    };
+
+    static std::string expandUploadUrl(const UploadOption& upload, size_t part)
+    {
+        std::string url = upload.urlTemplate;
+        std::string part_str = std::to_string(part);
+
+        auto replace = [&url](const std::string& key, const std::string& val)
+        {
+            size_t pos = 0;
+            while ((pos = url.find(key, pos)) != std::string::npos)
+            {
+                url.replace(pos, key.size(), val);
+                pos += val.size();
+            }
+        };
+
+        replace("{part}", part_str);
+        replace("{upload_id}", upload.uploadId);
+
+        return url;
+    }
+
+    static size_t uploadHeaderData(char *ptr, size_t size, size_t nmemb, void *stream)
+    {
+        UploadBlock* block = (UploadBlock*)stream;
+        size_t length = size * nmemb;
+
+        if (length > 5 && strncasecmp(ptr, "etag:", 5) == 0)
+        {
+            std::string tag(ptr + 5, length - 5);
+            size_t begin = tag.find_first_not_of(" \t");
+            size_t end = tag.find_last_not_of(" \t\r\n");
+            block->tag = begin == std::string::npos ? "" : tag.substr(begin, end - begin + 1);
+        }
+
+        return length;
+    }
+
+    static size_t discardWriteData(void *, size_t size, size_t nmemb, void *)
+    {
+        return size * nmemb;
+    }
+
+    static bool mapUploadFile(const std::string& filepath, UploadTask& task)
+    {
+        task.fd = open(filepath.c_str(), O_RDONLY);
+        if (task.fd < 0)
+        {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(task.fd, &st) != 0)
+        {
+            close(task.fd);
+            return false;
+        }
+
+        task.length = (size_t)st.st_size;
+        task.data = nullptr;
+
+        if (task.length > 0)
+        {
+            task.data = mmap(nullptr, task.length, PROT_READ, MAP_SHARED, task.fd, 0);
+            if (task.data == MAP_FAILED)
+            {
+                close(task.fd);
+                return false;
+            }
+
+            madvise(task.data, task.length, MADV_SEQUENTIAL);
+        }
+
+        return true;
+    }
+
+    static void unmapUploadFile(UploadTask& task)
+    {
+        if (task.data != nullptr)
+        {
+            munmap(task.data, task.length);
+        }
+
+        close(task.fd);
+    }
+
+    // =========================================
+    std::atomic<size_t> httpIndex{0};
+    static size_t newIndex()
+    {
+        return httpIndex++;
+    }
+
+    class LatencyTracker
+    {
+    public:
+        void Add(double ms)
+        {
+            if (samples.size() < LATENCY_SAMPLES)
+            {
+                samples.push_back(ms);
+            }
+            else
+            {
+                samples[next] = ms;
+            }
+
+            next = (next + 1) % LATENCY_SAMPLES;
+            stale = true;
+        }
+
+        size_t Count() const
+        {
+            return samples.size();
+        }
+
+        /* recomputed only after a new sample or for another p, the hedge check asks every loop */
+        double Percentile(double p)
+        {
+            if (samples.empty())
+            {
+                return 0;
+            }
+
+            if (stale || p != cachedP)
+            {
+                scratch.assign(samples.begin(), samples.end());
+                size_t n = std::min(scratch.size() - 1, (size_t)(p * scratch.size()));
+                std::nth_element(scratch.begin(), scratch.begin() + n, scratch.end());
+
+                cached = scratch[n];
+                cachedP = p;
+                stale = false;
+            }
+
+            return cached;
+        }
+
+    private:
+        std::vector<double> samples;
+        std::vector<double> scratch;
+        size_t next = 0;
+        bool stale = false;
+        double cached = 0;
+        double cachedP = -1;
+    };
+
+    class HedgeController
+    {
+        struct HedgeEntry
+        {
+            std::string url;
+            HttpOption opt;
+            std::string host;
+            std::chrono::steady_clock::time_point start;
+            bool started;
+            bool hedged;
+            std::vector<CURL*> handles;
+        };
+
+    public:
+        void SetPolicy(const HedgePolicy& p)
+        {
+            policy = p;
+        }
+
+        void Add(size_t id, const std::string& url, const HttpOption& opt, CURL* handle)
+        {
+            HedgeEntry& entry = entries[id];
+            entry.url = url;
+            entry.opt = opt;
+            entry.host = urlHost(url);
+            entry.started = false;
+            entry.hedged = false;
+            entry.handles.push_back(handle);
+
+            ++requests;
+        }
+
+        void Started(size_t id)
+        {
+            auto iter = entries.find(id);
+            if (iter != entries.end() && !iter->second.started)
+            {
+                iter->second.started = true;
+                iter->second.start = std::chrono::steady_clock::now();
+            }
+        }
+
+        /* sends the duplicate of every request slower than the policy delay, within the hedge budget;
+         * send returns nullptr while no connection is free and the request is checked again next loop */
+        void Check(std::function<CURL*(size_t, const std::string&, const HttpOption&)> send)
+        {
+            auto now = std::chrono::steady_clock::now();
+
+            for (auto& item: entries)
+            {
+                HedgeEntry& entry = item.second;
+                if (!entry.started || entry.hedged)
+                {
+                    continue;
+                }
+
+                double elapsed = std::chrono::duration<double, std::milli>(now - entry.start).count();
+                if (elapsed < Delay(entry.host) || hedges + 1 > policy.maxHedgeRatio * requests)
+                {
+                    continue;
+                }
+
+                std::string url = entry.opt.hedgeHost.empty() ? entry.url : replaceUrlHost(entry.url, entry.opt.hedgeHost);
+                CURL* handle = send(item.first, url, entry.opt);
+                if (handle == nullptr)
+                {
+                    break;
+                }
+
+                entry.handles.push_back(handle);
+                entry.hedged = true;
+                ++hedges;
+            }
+
+            if (requests > LATENCY_SAMPLES * 16)
+            {
+                requests /= 2;
+                hedges /= 2;
+            }
+        }
+
+        void Remove(size_t id)
+        {
+            entries.erase(id);
+        }
+
+        /* false means a sibling is still running and this response should be dropped */
+        bool Complete(CURL* handle, size_t id, bool ok, std::function<void(CURL*)> discard)
+        {
+            auto iter = entries.find(id);
+            if (iter == entries.end())
+            {
+                return true;
+            }
+
+            HedgeEntry& entry = iter->second;
+            entry.handles.erase(std::remove(entry.handles.begin(), entry.handles.end(), handle), entry.handles.end());
+
+            if (!ok && !entry.handles.empty())
+            {
+                return false;
+            }
+
+            if (ok)
+            {
+                double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - entry.start).count();
+                trackers[entry.host].Add(elapsed);
+            }
+
+            for (auto loser: entry.handles)
+            {
+                discard(loser);
+            }
+
+            entries.erase(iter);
+
+            return true;
+        }
+
+    private:
+        double Delay(const std::string& host)
+        {
+            LatencyTracker& tracker = trackers[host];
+            if (tracker.Count() < MIN_LATENCY_SAMPLES)
+            {
+                return policy.defaultDelayMs;
+            }
+
+            return std::max((double)policy.minDelayMs, tracker.Percentile(policy.percentile));
+        }
+
+        static std::string replaceUrlHost(const std::string& url, const std::string& host)
+        {
+            size_t begin = url.find("://");
+            begin = begin == std::string::npos ? 0 : begin + 3;
+
+            size_t end = url.find_first_of("/?#", begin);
+            end = end == std::string::npos ? url.size() : end;
+
+            size_t at = url.rfind('@', end);
+            if (at != std::string::npos && at >= begin)
+            {
+                begin = at + 1;
+            }
+
+            return url.substr(0, begin) + host + url.substr(end);
+        }
+
+        HedgePolicy policy;
+        std::map<size_t, HedgeEntry> entries;
+        std::map<std::string, LatencyTracker> trackers;
+        double requests = 0;
+        double hedges = 0;
+    };
+
+    // =========================================
+    static HttpOption defaultHttpOption(const std::string& url)
+    {
+        HttpOption opt;
+
+        opt.verbose = false;
+        opt.useSSL = url.substr(0, 5) == "https";
+        opt.verifyHost = opt.useSSL;
+        opt.verifyPeer = opt.useSSL;
+        opt.useHttp2 = opt.useSSL;
+        opt.userAgent = "ftxHttpClient";
+
+        return opt;
+    }
+
+    /* the prototype handle is built on the curl thread of the engine that made the template */
+    class RequestTemplate::Impl
+    {
+    public:
+        ~Impl()
+        {
+            if (handle != nullptr)
+            {
+                curl_easy_cleanup(handle);
+            }
+        }
+
+        CURL* handle = nullptr;
+        std::string baseUrl;
+        std::string host;
+        HttpOption opt;
+        bool post = false;
+    };
+
+    /* everything one engine owns, shared by its curl thread, its disk writer and the thread calling Loop() */
+    class HttpEngine::Impl : public std::enable_shared_from_this<HttpEngine::Impl>
+    {
+    public:
+        Impl()
+        : diskWriter(httpTaskManager, writeBufferPool), downloadSink(diskWriter, writeBufferPool)
+        , random(std::random_device{}())
+        {
+
+        }
+
+        void StartUp(long max_connects);
+        void ShutDown();
+        void Loop();
+
+        size_t PushDownload(const std::string& url, const std::string& filepath
+                , std::function<void(bool, std::string)> callback, size_t block_size, bool need_resume);
+        size_t PushDownloadEx(const std::string& url, const std::string& filepath, const HttpOption& opt
+                , std::function<void(bool, std::string)> callback, size_t block_size, bool need_resume);
+        size_t PushDownloadMirrors(const std::vector<std::string>& urls, const std::string& filepath
+                , std::function<void(bool, std::string)> callback, size_t block_size, bool need_resume);
+        size_t PushDownloadMirrorsEx(const std::vector<std::string>& urls, const std::string& filepath, const HttpOption& opt
+                , std::function<void(bool, std::string)> callback, size_t block_size, bool need_resume);
+        size_t PushDownloadDelta(const std::string& url, const std::string& manifest_url, const std::string& basepath
+                , const std::string& filepath, std::function<void(bool, std::string)> callback);
+        size_t PushDownloadDeltaEx(const std::string& url, const std::string& manifest_url, const std::string& basepath
+                , const std::string& filepath, const HttpOption& opt, std::function<void(bool, std::string)> callback);
+        size_t PushBulk(const std::vector<BulkItem>& items, const std::string& statepath
+                , std::function<void(bool, std::vector<std::string>)> callback, long long small_file_size);
+        size_t PushBulkEx(const std::vector<BulkItem>& items, const std::string& statepath, const HttpOption& opt
+                , std::function<void(bool, std::vector<std::string>)> callback, long long small_file_size);
+        std::tuple<size_t, size_t, long long> BulkProgress(size_t id);
+        void SetDownloadQueue(const std::string& state_dir, const HttpOption& opt
+                , std::function<void(bool, std::string)> callback, long max_active_files);
+        size_t QueueDownload(const std::string& url, const std::string& filepath, size_t block_size);
+        size_t PushUpload(const std::string& filepath, const UploadOption& upload
+                , std::function<void(bool, std::string, std::vector<std::string>)> callback, size_t block_size, bool need_resume);
+        size_t PushUploadEx(const std::string& filepath, const UploadOption& upload, const HttpOption& opt
+                , std::function<void(bool, std::string, std::vector<std::string>)> callback, size_t block_size, bool need_resume);
+        void ClearUpload(const std::string& filepath);
+
+        double DownloadSpeed(const std::string& filepath);
+        double DownloadSize(const std::string& filepath);
+        std::tuple<double, double> DownloadSpeedAndSize(const std::string& filepath);
+        double DownloadAllSpeed();
+        void ClearDownload(const std::string& filepath);
+
+        void Cancel(size_t id);
+        void CancelDownload(const std::string& filepath);
+
+        void SetSpeedLimit(long long bytes_per_sec);
+        void SetHostSpeedLimit(const std::string& host, long long bytes_per_sec);
+        void SetDownloadSpeedLimit(const std::string& filepath, long long bytes_per_sec);
+        void SetHedgePolicy(const HedgePolicy& policy);
+        void SetWriteBuffers(size_t buffer_size, size_t buffer_count);
+        void SetMaxHostConnections(long max_host_connects);
+        void SetMaxConcurrentStreams(long max_streams);
+        void SetMaxBulkTransfers(long max_transfers);
+        void SetHostHttpVersion(const std::string& host, HttpVersion version);
+        void SetHostUnixSocket(const std::string& host, const std::string& path, bool abstract);
+
+        void Prewarm(const std::vector<std::string>& urls, long connections_per_host);
+        void PrewarmEx(const std::string& url, const HttpOption& opt, long connections_per_host);
+        void AddResolve(const std::string& host, int port, const std::string& address);
+        void ClearResolve();
+
+        size_t RequestGet(const std::string& url, std::function<void(long, std::string)> callback);
+        size_t RequestPost(const std::string& url, const std::string& params_str, std::function<void(long, std::string)> callback);
+        size_t RequestGetEx(const std::string& url, const HttpOption& opt, std::function<void(long, std::string)> callback);
+        size_t RequestPostEx(const std::string& url, const HttpOption& opt, const std::string& params_str
+                , std::function<void(long, std::string)> callback);
+        std::shared_ptr<RequestTemplate::Impl> CreateRequestTemplate(const std::string& base_url, const HttpOption& opt
+                , bool post);
+        size_t RequestWithTemplate(const std::shared_ptr<RequestTemplate::Impl>& proto, const std::string& path
+                , const std::string& body, std::function<void(long, std::string)> callback);
+        size_t RequestGetWithHeaders(const std::string& url, const HttpOption& opt
+                , std::function<void(long, const HttpResponseHeaders&, std::string)> callback);
+        size_t RequestPostWithHeaders(const std::string& url, const HttpOption& opt, const std::string& params_str
+                , std::function<void(long, const HttpResponseHeaders&, std::string)> callback);
+        size_t RequestWithTemplateHeaders(const std::shared_ptr<RequestTemplate::Impl>& proto, const std::string& path
+                , const std::string& body, std::function<void(long, const HttpResponseHeaders&, std::string)> callback);
+
+        void curlPerformLoop();
+        void checkDownloadFinished(const std::string& filepath);
+
+        std::atomic<bool> httpThreadAlive{false};
+        long maxConnects = 20;
+        long maxDownloadConnects = CONNECTS_FOR_DOWNLOAD;
+        long maxHostConnects = 0;
+        long maxConcurrentStreams = 100;
+
+        HttpTaskManager httpTaskManager;
+        TimerQueue timerQueue;
+        WriteBufferPool writeBufferPool;
+        DiskWriter diskWriter;
+        HashWorker hashWorker;
+        DownloadSink downloadSink;
+        DownloadDashboard downloadDashboard;
+        BandwidthShaper bandwidthShaper;
+        std::mt19937 random;
+
+        std::map<std::string, std::map<long, DownloadResult>> downloadResultTable;
+
+        // ==============================================
+
+        CURLM* curlm = nullptr;
+        std::deque<CURL*> waitRequestHandles;
+        std::deque<CURL*> waitDownloadHandles;
+
+        /* each handle pins the list it was given; resolved entries stay in the multi dns cache for good,
+         * so cleared ones go out as "-host:port" with the next transfer that starts */
+        std::vector<std::string> resolveEntries;
+        std::set<std::string> clearedResolves;
+        std::shared_ptr<curl_slist> resolveList;
+
+        static std::string resolveKey(const std::string& entry)
+        {
+            return entry.substr(0, entry.find(':', entry.find(':') + 1));
+        }
+
+        void rebuildResolveList()
+        {
+            curl_slist* list = nullptr;
+            for (auto& key: clearedResolves)
+            {
+                list = curl_slist_append(list, ("-" + key).c_str());
+            }
+
+            for (auto& entry: resolveEntries)
+            {
+                list = curl_slist_append(list, entry.c_str());
+            }
+
+            resolveList = list == nullptr ? nullptr : std::shared_ptr<curl_slist>(list, curl_slist_free_all);
+        }
+
+        void applyResolveList(CURL* handle, RequestTypeOption* reqtype)
+        {
+            curl_easy_setopt(handle, CURLOPT_RESOLVE, resolveList.get());
+            if (reqtype != nullptr)
+            {
+                reqtype->resolve = resolveList;
+            }
+        }
+
+        void clearResolveLists()
+        {
+            resolveEntries.clear();
+            clearedResolves.clear();
+            resolveList.reset();
+        }
+
+        std::map<std::string, HttpVersion> hostHttpVersion;
+        std::map<std::string, std::tuple<std::string, bool>> hostUnixSocket;
+
+        CURL* setCurlOptEx(CURL** handle, const std::string& url, const HttpOption& opt)
+        {
+            curl_easy_setopt(*handle, CURLOPT_VERBOSE, opt.verbose);
+
+            std::string host = urlHost(url);
+            HttpVersion version = opt.httpVersion;
+            auto policy = hostHttpVersion.find(host);
+            if (policy != hostHttpVersion.end())
+            {
+                version = policy->second;
+            }
+
+            /* a handle moved to another mirror must not keep the socket of the previous one */
+            const std::string* socket_path = &opt.unixSocketPath;
+            bool abstract = opt.abstractSocket;
+            auto local = hostUnixSocket.find(host);
+            if (local != hostUnixSocket.end())
+            {
+                socket_path = &std::get<0>(local->second);
+                abstract = std::get<1>(local->second);
+            }
+
+            if (!socket_path->empty())
+            {
+                curl_easy_setopt(*handle, abstract ? CURLOPT_ABSTRACT_UNIX_SOCKET : CURLOPT_UNIX_SOCKET_PATH, socket_path->c_str());
+            }
+            else
+            {
+                curl_easy_setopt(*handle, CURLOPT_UNIX_SOCKET_PATH, (char*)nullptr);
+            }
+
+            curl_easy_setopt(*handle, CURLOPT_HTTP_VERSION, curlHttpVersion(version));
+            if (opt.useHttp2 || version == HttpVersion::Http2 || version == HttpVersion::Http2PriorKnowledge)
+            {
+                curl_easy_setopt(*handle, CURLOPT_PIPEWAIT, 1L);
+            }
+
+            /* the handle keeps the lists alive, the option they came from may be gone before the transfer ends */
+            RequestTypeOption* reqtype = nullptr;
+            curl_easy_getinfo(*handle, CURLINFO_PRIVATE, &reqtype);
+            applyResolveList(*handle, reqtype);
+
+            if (!opt.headers.Empty())
+            {
+                curl_easy_setopt(*handle, CURLOPT_HTTPHEADER, opt.headers.Shared()->slist);
+                if (reqtype != nullptr)
+                {
+                    reqtype->headers = opt.headers.Shared();
+                }
+            }
+
+            curl_easy_setopt(*handle, CURLOPT_CONNECTTIMEOUT_MS, opt.connectTimeoutMs);
+            curl_easy_setopt(*handle, CURLOPT_TIMEOUT_MS, opt.timeoutMs);
+            curl_easy_setopt(*handle, CURLOPT_LOW_SPEED_LIMIT, opt.lowSpeedLimit);
+            curl_easy_setopt(*handle, CURLOPT_LOW_SPEED_TIME, opt.lowSpeedTime);
+
+            if (!opt.userAgent.empty())
+            {
+                curl_easy_setopt(*handle, CURLOPT_USERAGENT, opt.userAgent.c_str());
+            }
+
+            if (opt.useSSL)
+            {
+                curl_easy_setopt(*handle, CURLOPT_SSL_VERIFYPEER, opt.verifyPeer);
+                curl_easy_setopt(*handle, CURLOPT_SSL_VERIFYHOST, opt.verifyHost);
+
+                if (!opt.certFile.empty())
+                {
+                    curl_easy_setopt(*handle, CURLOPT_CAINFO, opt.certFile.c_str());
+                }
+            }
+
+            return *handle;
+        }
+
+        void sendLengthProbe(LengthProbe* probe)
+        {
+            const std::string& url = probe->urls[probe->next];
+            CURL* curl = curl_easy_init();
+            RequestTypeOption* reqtype = takeRequestOption(RequestType::HttpProbe, probe);
+
+            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+            curl_easy_setopt(curl, CURLOPT_AUTOREFERER, 1L);
+            curl_easy_setopt(curl, CURLOPT_HEADER, 0L);
+            curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(curl, CURLOPT_PRIVATE, reqtype);
+
+            setCurlOptEx(&curl, url, probe->opt);
+
+            waitRequestHandles.push_back(curl);
+        }
+
+        /* done gets -1 when no mirror reports a length; a cancelled download drops its probe and never hears back */
+        void probeDownloadLength(const std::vector<std::string>& urls, const std::string& filepath, const HttpOption& opt
+                , std::function<void(long)> done)
+        {
+            if (urls.empty())
+            {
+                done(-1);
+                return ;
+            }
+
+            LengthProbe* probe = new LengthProbe();
+            probe->urls = urls;
+            probe->next = 0;
+            probe->filepath = filepath;
+            probe->opt = opt;
+            probe->done = done;
+
+            sendLengthProbe(probe);
+        }
+
+        /* takes the probe back from the finished handle, asks the next mirror or hands the length over */
+        void finishLengthProbe(CURL* handle, RequestTypeOption* reqtype, bool ok)
+        {
+            LengthProbe* probe = (LengthProbe*) reqtype->data;
+            reqtype->data = nullptr;
+
+            curl_off_t length = -1;
+            if (ok)
+            {
+                curl_easy_getinfo(handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+            }
+
+            if (length < 0 && ++probe->next < probe->urls.size())
+            {
+                sendLengthProbe(probe);
+                return ;
+            }
+
+            std::function<void(long)> done = probe->done;
+            delete probe;
+            done((long)length);
+        }
+
+        /* the blocks still to fetch: from the .ftxlog when resuming, otherwise from a HEAD probe on the multi */
+        void planDownload(const std::vector<std::string>& urls, const std::string& filepath, const HttpOption& opt
+                , size_t block_size, bool need_resume, std::function<void(BlockList)> done)
+        {
+            std::string logfile = HttpClient::FileLogFullPath(filepath);
+            if (need_resume)
+            {
+                BlockList blockList = FileTool::LoadBlocks(logfile);
+                if (!blockList.all.empty())
+                {
+                    done(blockList);
+                    return ;
+                }
+            }
+
+            probeDownloadLength(urls, filepath, opt, [block_size, need_resume, logfile, done](long filesize){
+                BlockList blockList;
+                size_t block_size_byte = block_size * 1024 * 1024;
+
+                long begin = 0;
+                while (begin < filesize)
+                {
+                    long end = std::min(filesize, (long)(begin + block_size_byte));
+                    blockList.all.push_back(std::make_tuple(begin, end));
+                    begin += block_size_byte;
+                }
+
+                if (need_resume)
+                {
+                    FileTool::WriteBlocks(logfile, blockList);
+                }
+
+                done(blockList);
+            });
+        }
+
+        static size_t downloadWriteData(void *ptr, size_t size, size_t nmemb, void *stream)
+        {
+            DownloadBlock* block = (DownloadBlock*)stream;
+            size_t length = size * nmemb;
+
+            /* an error page fails the block before a byte is written, a 200 only fits a block that is the whole file */
+            if (!block->ranged)
+            {
+                long code = 0;
+                curl_off_t filesize = -1;
+                curl_easy_getinfo(block->handle, CURLINFO_RESPONSE_CODE, &code);
+                curl_easy_getinfo(block->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &filesize);
+                bool whole = code == 200 && block->start == 0 && filesize >= 0 && filesize <= block->end;
+                if (code != 206 && !whole)
+                {
+                    block->unranged = code == 200;
+                    return 0;
+                }
+
+                block->ranged = true;
+            }
+
+            if (!block->engine->downloadSink.Reserve(block, length))
+            {
+                return CURL_WRITEFUNC_PAUSE;
+            }
+
+            if (!block->engine->bandwidthShaper.Acquire(block->handle, block->host, block->filepath, length))
+            {
+                return CURL_WRITEFUNC_PAUSE;
+            }
+
+            block->engine->downloadSink.Append(block, (const char*)ptr, length);
+            block->start += length;
+
+            curl_off_t speed;
+            curl_off_t already;
+            curl_easy_getinfo(block->handle, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+            curl_easy_getinfo(block->handle, CURLINFO_SIZE_DOWNLOAD_T, &already);
+
+            block->engine->downloadDashboard.UpdateInfo(block->filepath, block->index, (double)speed, (double)already);
+
+            return length;
+        }
+
+        std::map<std::string, DownloadTask> downloadTaskTable;
+
+        CURL* createDownloadBlock(const std::string& url, const std::string& filepath, size_t index
+                , long start, long end, bool resume, const HttpOption& opt)
+        {
+            CURL* curl = curl_easy_init();
+            char range[64];
+            sprintf(range, "%ld-%ld", start, end);
+
+            DownloadBlock* block = takeDownloadBlock(curl, start, end, resume, index, filepath);
+            block->engine = this;
+            block->host = urlHost(url);
+            RequestTypeOption* reqtype = takeRequestOption(RequestType::HttpDownload, block);
+
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, downloadWriteData);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, block);
+            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(curl, CURLOPT_HEADER, 0L);
+            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(curl, CURLOPT_PRIVATE, reqtype);
+            curl_easy_setopt(curl, CURLOPT_RANGE, range);
+
+            setCurlOptEx(&curl, url, opt);
+
+            if (!opt.multiplexBlocks)
+            {
+                curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+                curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 0L);
+            }
+
+            return curl;
+        }
+
+        /* called when a block is admitted to the multi handle */
+        void assignMirror(CURL* curl)
+        {
+            RequestTypeOption* reqtype;
+            curl_easy_getinfo(curl, CURLINFO_PRIVATE, &reqtype);
+            DownloadBlock* block = (DownloadBlock*) reqtype->data;
+
+            auto iter = downloadTaskTable.find(block->filepath);
+            if (iter == downloadTaskTable.end())
+            {
+                return ;
+            }
+
+            DownloadTask& task = iter->second;
+            size_t index = chooseMirror(task);
+            MirrorState& mirror = task.mirrors[index];
+
+            if (index != block->mirror)
+            {
+                curl_easy_setopt(curl, CURLOPT_URL, mirror.url.c_str());
+                setCurlOptEx(&curl, mirror.url, task.opt);
+
+                if (!task.opt.multiplexBlocks)
+                {
+                    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+                    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 0L);
+                }
+            }
+
+            block->mirror = index;
+            block->host = mirror.host;
+            ++mirror.inflight;
+        }
+
+        void releaseMirror(DownloadBlock* block, bool success, double speed)
+        {
+            auto iter = downloadTaskTable.find(block->filepath);
+            if (iter == downloadTaskTable.end() || block->mirror >= iter->second.mirrors.size())
+            {
+                return ;
+            }
+
+            MirrorState& mirror = iter->second.mirrors[block->mirror];
+            --mirror.inflight;
+
+            if (!success)
+            {
+                ++mirror.failures;
+                return ;
+            }
+
+            mirror.failures = 0;
+            mirror.throughput = mirror.samples == 0 ? speed
+                    : (1 - MIRROR_THROUGHPUT_WEIGHT) * mirror.throughput + MIRROR_THROUGHPUT_WEIGHT * speed;
+            ++mirror.samples;
+        }
+
+        void pushDownload(size_t id, const std::vector<std::string>& urls, const BlockList& blockList
+                , const std::string& filepath, bool resume, const HttpOption& opt)
+        {
+            DownloadTask& task = downloadTaskTable[filepath];
+            task.id = id;
+            task.mirrors.clear();
+            for (auto& url: urls)
+            {
+                task.mirrors.push_back(MirrorState{url, urlHost(url), 0, 0, 0, 0});
+            }
+            task.opt = opt;
+            task.resume = resume;
+            task.retriesLeft = opt.retryBudget;
+            task.attempts.clear();
+
+            for (size_t i = 0; i < blockList.all.size(); ++i)
+            {
+                long start;
+                long end;
+                std::tie(start, end) = blockList.all[i];
+
+                if (start >= end)
+                {
+                    downloadResultTable[filepath][i] = DownloadResult::Succeed;
+                    continue;
+                }
+
+                CURL* curl = createDownloadBlock(urls[0], filepath, i, start, end, resume, opt);
+
+                waitDownloadHandles.push_back(curl);
+                downloadResultTable[filepath][i] = DownloadResult::None;
+            }
+        }
+
+        /* exponential backoff with full jitter, false when the file is out of retries */
+        bool retryDownloadBlock(const std::string& filepath, size_t index, long start, long end)
+        {
+            auto iter = downloadTaskTable.find(filepath);
+            if (iter == downloadTaskTable.end() || iter->second.retriesLeft <= 0)
+            {
+                return false;
+            }
+
+            DownloadTask& task = iter->second;
+            --task.retriesLeft;
+            int attempt = task.attempts[index]++;
+            size_t id = task.id;
+
+            long ceiling = std::min(task.opt.retryMaxDelayMs, task.opt.retryBaseDelayMs << std::min(attempt, 20));
+            long delay = std::uniform_int_distribution<long>(0, std::max(0L, ceiling))(random);
+
+            timerQueue.Push(delay, [this, id, filepath, index, start, end]() {
+                auto iter = downloadTaskTable.find(filepath);
+                if (iter == downloadTaskTable.end() || iter->second.id != id)
+                {
+                    return ;
+                }
+
+                DownloadTask& task = iter->second;
+                CURL* curl = createDownloadBlock(task.mirrors[0].url, filepath, index, start, end, task.resume, task.opt);
+                waitDownloadHandles.push_back(curl);
+            });
+
+            return true;
+        }
+
+        static size_t appendWriteData(void *ptr, size_t size, size_t nmemb, void *stream)
+        {
+            size_t length = size * nmemb;
+            ((std::string*)stream)->append((const char*)ptr, length);
+            return length;
+        }
+
+        /* the manifest comes over the multi, the base file is matched on the hash worker, only the ranges come back */
+        std::map<std::string, size_t> pendingDeltas;
+
+        void pushDelta(size_t id, const std::string& url, const std::string& manifest_url, const std::string& basepath
+                , const std::string& filepath, const HttpOption& opt)
+        {
+            pendingDeltas[filepath] = id;
+
+            ManifestFetch* fetch = new ManifestFetch();
+            fetch->id = id;
+            fetch->url = url;
+            fetch->basepath = basepath;
+            fetch->filepath = filepath;
+            fetch->opt = opt;
+
+            CURL* curl = curl_easy_init();
+            RequestTypeOption* reqtype = takeRequestOption(RequestType::HttpManifest, fetch);
+
+            curl_easy_setopt(curl, CURLOPT_URL, manifest_url.c_str());
+            curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, appendWriteData);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &fetch->body);
+            curl_easy_setopt(curl, CURLOPT_PRIVATE, reqtype);
+
+            setCurlOptEx(&curl, manifest_url, opt);
+
+            waitRequestHandles.push_back(curl);
+        }
+
+        void finishManifestFetch(RequestTypeOption* reqtype, bool ok)
+        {
+            std::shared_ptr<ManifestFetch> fetch((ManifestFetch*) reqtype->data);
+            reqtype->data = nullptr;
+
+            auto pending = pendingDeltas.find(fetch->filepath);
+            if (pending == pendingDeltas.end() || pending->second != fetch->id)
+            {
+                return ;
+            }
+
+            if (!ok)
+            {
+                finishDelta(fetch->id, fetch->url, fetch->filepath, fetch->opt, false, BlockList());
+                return ;
+            }
+
+            /* the worker only runs while the http thread holds the engine, a cancel drops the job if it is still queued */
+            hashWorker.Post(fetch->filepath, [this, fetch](){
+                DeltaManifest manifest;
+                BlockList missing;
+                bool ok = DeltaTool::Parse(fetch->body, manifest)
+                        && DeltaTool::Assemble(manifest, fetch->basepath, HttpClient::FilePath2TmpPath(fetch->filepath)
+                                , missing);
+
+                httpTaskManager.PushToBackgroundThread([this, fetch, ok, missing](){
+                    finishDelta(fetch->id, fetch->url, fetch->filepath, fetch->opt, ok, missing);
+                });
+            });
+        }
+
+        void finishDelta(size_t id, const std::string& url, const std::string& filepath, const HttpOption& opt, bool ok
+                , const BlockList& missing)
+        {
+            auto iter = pendingDeltas.find(filepath);
+            if (iter == pendingDeltas.end() || iter->second != id)
+            {
+                return ;
+            }
+
+            pendingDeltas.erase(iter);
+            if (ok)
+            {
+                pushDownload(id, std::vector<std::string>(1, url), missing, filepath, false, opt);
+            }
+            else
+            {
+                downloadResultTable[filepath][0] = DownloadResult::Failed;
+            }
+
+            checkDownloadFinished(filepath);
+        }
+
+        // =========================================
+        /* small items of a bulk are one whole-file GET each, no probe, no split and no journal */
+        std::map<size_t, BulkTask> bulkTaskTable;
+        std::map<std::string, std::function<void(bool)>> downloadHooks;
+        long maxBulkTransfers = BULK_MAX_TRANSFERS;
+        long bulkTransfers = 0;
+
+        static size_t bulkWriteData(void *ptr, size_t size, size_t nmemb, void *stream)
+        {
+            DownloadBlock* block = (DownloadBlock*)stream;
+            Impl* engine = block->engine;
+            size_t length = size * nmemb;
+
+            if (!engine->downloadSink.Reserve(block, length))
+            {
+                return CURL_WRITEFUNC_PAUSE;
+            }
+
+            auto task = engine->bulkTaskTable.find(block->bulk);
+            const std::string& key = task == engine->bulkTaskTable.end() ? block->filepath : task->second.statepath;
+            if (!engine->bandwidthShaper.Acquire(block->handle, block->host, key, length))
+            {
+                return CURL_WRITEFUNC_PAUSE;
+            }
+
+            engine->downloadSink.Append(block, (const char*)ptr, length);
+            block->start += length;
+
+            return length;
+        }
+
+        CURL* createBulkItem(size_t id, size_t item, const BulkTask& task)
+        {
+            const BulkItem& entry = task.items[item];
+            CURL* curl = curl_easy_init();
+
+            DownloadBlock* block = takeDownloadBlock(curl, 0, 0, false, item, entry.filepath);
+            block->engine = this;
+            block->host = urlHost(entry.url);
+            block->bulk = id;
+            if (block->sink->fd >= 0 && ftruncate(block->sink->fd, 0) != 0)
+            {
+                block->sink->failed = true;
+            }
+            RequestTypeOption* reqtype = takeRequestOption(RequestType::HttpBulk, block);
+
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, bulkWriteData);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, block);
+            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(curl, CURLOPT_HEADER, 0L);
+            curl_easy_setopt(curl, CURLOPT_URL, entry.url.c_str());
+            curl_easy_setopt(curl, CURLOPT_PRIVATE, reqtype);
+
+            setCurlOptEx(&curl, entry.url, task.opt);
+
+            return curl;
+        }
+
+        /* a large item keeps the split and the journal, only the HEAD probe is saved by the known size */
+        void pushBulkLarge(size_t id, size_t item, const BulkTask& task)
+        {
+            const BulkItem entry = task.items[item];
+            std::string logfile = HttpClient::FileLogFullPath(entry.filepath);
+            BlockList blockList = FileTool::LoadBlocks(logfile);
+            if (blockList.all.empty())
+            {
+                for (long long begin = 0; begin < entry.size; begin += BULK_BLOCK_SIZE)
+                {
+                    blockList.all.push_back(std::make_tuple((long)begin, (long)std::min(entry.size, begin + BULK_BLOCK_SIZE)));
+                }
+                FileTool::WriteBlocks(logfile, blockList);
+            }
+
+            /* the temp file is checked before it takes the final name, a mismatch starts the item over */
+            downloadHooks[entry.filepath] = [this, id, item, entry](bool ok){
+                if (!ok || entry.hash.empty())
+                {
+                    if (ok)
+                    {
+                        FileTool::DowdloadFinish(entry.filepath);
+                    }
+                    finishBulkItem(id, item, ok, ok ? entry.size : 0);
+                    return ;
+                }
+
+                std::string tmpfilepath = HttpClient::FilePath2TmpPath(entry.filepath);
+                hashWorker.Post(entry.filepath, [this, id, item, entry, tmpfilepath](){
+                    bool ok = DeltaTool::Digest(tmpfilepath) == entry.hash;
+                    httpTaskManager.PushToBackgroundThread([this, id, item, ok, entry](){
+                        if (bulkTaskTable.count(id) == 0)
+                        {
+                            return ;
+                        }
+
+                        if (ok)
+                        {
+                            FileTool::DowdloadFinish(entry.filepath);
+                            finishBulkItem(id, item, true, entry.size);
+                            return ;
+                        }
+
+                        FileTool::ClearTempAndLogFiles(entry.filepath);
+                        if (!retryBulkItem(id, item, true))
+                        {
+                            finishBulkItem(id, item, false, 0);
+                        }
+                    });
+                });
+            };
+
+            pushDownload(newIndex(), std::vector<std::string>(1, entry.url), blockList, entry.filepath, true, task.opt);
+            checkDownloadFinished(entry.filepath);
+        }
+
+        void pushBulk(size_t id, const std::vector<BulkItem>& items, const std::string& statepath, const HttpOption& opt
+                , long long small_file_size)
+        {
+            BulkTask& task = bulkTaskTable[id];
+            task.items = items;
+            task.opt = opt;
+            task.statepath = statepath;
+
+            std::string manifest;
+            for (auto& entry: items)
+            {
+                manifest.append(entry.url).append(1, '\n').append(entry.filepath).append(1, '\n');
+            }
+
+            uint64_t count = items.size();
+            uint64_t key = DeltaTool::Checksum(manifest);
+            task.done = FileTool::LoadBulkState(statepath, count, key);
+            if (task.done.empty())
+            {
+                task.done.assign((size_t)(count + 7) / 8, 0);
+                FileTool::WriteBulkState(statepath, count, key, task.done);
+            }
+            task.statefd = open(statepath.c_str(), O_WRONLY);
+
+            std::vector<size_t> large;
+            for (size_t i = 0; i < items.size(); ++i)
+            {
+                if (task.done[i / 8] & (1 << (i % 8)))
+                {
+                    continue;
+                }
+
+                if (items[i].size > small_file_size)
+                {
+                    large.push_back(i);
+                }
+                else
+                {
+                    task.queue.push_back(i);
+                }
+            }
+
+            task.remaining = task.queue.size() + large.size();
+            size_t finished = items.size() - task.remaining;
+            httpTaskManager.PushToForeground([this, id, finished](){
+                auto iter = bulkProgressMap.find(id);
+                if (iter != bulkProgressMap.end())
+                {
+                    std::get<0>(iter->second) += finished;
+                }
+            });
+
+            if (task.remaining == 0)
+            {
+                finishBulk(id);
+                return ;
+            }
+
+            /* the last one may finish the whole bulk right away when its journal is complete */
+            for (auto i: large)
+            {
+                pushBulkLarge(id, i, task);
+            }
+        }
+
+        /* bulk transfers have their own budget so a large manifest does not crowd out the other queues */
+        void admitBulkItems()
+        {
+            for (auto iter = bulkTaskTable.begin(); iter != bulkTaskTable.end() && bulkTransfers < maxBulkTransfers; ++iter)
+            {
+                BulkTask& task = iter->second;
+                while (!task.queue.empty() && bulkTransfers < maxBulkTransfers)
+                {
+                    size_t item = task.queue.front();
+                    task.queue.pop_front();
+                    addToMulti(createBulkItem(iter->first, item, task));
+                    ++bulkTransfers;
+                }
+            }
+        }
+
+        /* runs once the item is on disk, the digest of the temp file is taken on the hash worker */
+        void completeBulkItem(size_t id, size_t item, bool ok, long received)
+        {
+            auto iter = bulkTaskTable.find(id);
+            if (iter == bulkTaskTable.end())
+            {
+                return ;
+            }
+
+            const BulkItem& entry = iter->second.items[item];
+            std::string tmpfilepath = HttpClient::FilePath2TmpPath(entry.filepath);
+
+            ok = ok && (entry.size < 0 || received == entry.size);
+            if (ok && !entry.hash.empty())
+            {
+                std::string hash = entry.hash;
+                hashWorker.Post(entry.filepath, [this, id, item, received, tmpfilepath, hash](){
+                    bool ok = DeltaTool::Digest(tmpfilepath) == hash;
+                    httpTaskManager.PushToBackgroundThread([this, id, item, ok, received](){
+                        acceptBulkItem(id, item, ok, received);
+                    });
+                });
+                return ;
+            }
+
+            acceptBulkItem(id, item, ok, received);
+        }
+
+        void acceptBulkItem(size_t id, size_t item, bool ok, long received)
+        {
+            auto iter = bulkTaskTable.find(id);
+            if (iter == bulkTaskTable.end())
+            {
+                return ;
+            }
+
+            const BulkItem& entry = iter->second.items[item];
+            std::string tmpfilepath = HttpClient::FilePath2TmpPath(entry.filepath);
+            ok = ok && std::rename(tmpfilepath.c_str(), entry.filepath.c_str()) == 0;
+
+            if (!ok && retryBulkItem(id, item, false))
+            {
+                return ;
+            }
+
+            finishBulkItem(id, item, ok, received);
+        }
+
+        /* small items rejoin the queue, large ones start over with a new journal; false once the budget is spent */
+        bool retryBulkItem(size_t id, size_t item, bool large)
+        {
+            BulkTask& task = bulkTaskTable[id];
+            if (task.attempts[item] >= task.opt.retryBudget)
+            {
+                return false;
+            }
+
+            int attempt = task.attempts[item]++;
+            long ceiling = std::min(task.opt.retryMaxDelayMs, task.opt.retryBaseDelayMs << std::min(attempt, 20));
+            long delay = std::uniform_int_distribution<long>(0, std::max(0L, ceiling))(random);
+
+            timerQueue.Push(delay, [this, id, item, large]() {
+                auto iter = bulkTaskTable.find(id);
+                if (iter == bulkTaskTable.end())
+                {
+                    return ;
+                }
+
+                if (large)
+                {
+                    pushBulkLarge(id, item, iter->second);
+                }
+                else
+                {
+                    iter->second.queue.push_back(item);
+                }
+            });
+            return true;
+        }
+
+        void finishBulkItem(size_t id, size_t item, bool ok, long long received)
+        {
+            auto iter = bulkTaskTable.find(id);
+            if (iter == bulkTaskTable.end())
+            {
+                return ;
+            }
+
+            BulkTask& task = iter->second;
+            if (ok)
+            {
+                size_t pos = item / 8;
+                task.done[pos] |= (unsigned char)(1 << (item % 8));
+                if (task.statefd >= 0 && pwrite(task.statefd, &task.done[pos], 1, BULK_STATE_HEADER + pos) != 1)
+                {
+                    fprintf(stderr, "E: bulk state %s: %s\n", task.statepath.c_str(), strerror(errno));
+                }
+            }
+            else
+            {
+                task.failed.push_back(task.items[item].filepath);
+            }
+
+            httpTaskManager.PushToForeground([this, id, received](){
+                auto iter = bulkProgressMap.find(id);
+                if (iter != bulkProgressMap.end())
+                {
+                    ++std::get<0>(iter->second);
+                    std::get<2>(iter->second) += received;
+                }
+            });
+
+            if (--task.remaining == 0)
+            {
+                finishBulk(id);
+            }
+        }
+
+        void finishBulk(size_t id)
+        {
+            BulkTask& task = bulkTaskTable[id];
+            if (task.statefd >= 0)
+            {
+                close(task.statefd);
+            }
+
+            bool succeed = task.failed.empty();
+            if (succeed)
+            {
+                std::remove(task.statepath.c_str());
+            }
+
+            std::vector<std::string> failed = task.failed;
+            httpTaskManager.PushToForeground([this, id, succeed, failed](){
+                auto callback = bulkCallbackMap[id];
+                if (callback != nullptr)
+                {
+                    callback(succeed, failed);
+                }
+
+                bulkCallbackMap.erase(id);
+                bulkProgressMap.erase(id);
+            });
+
+            bandwidthShaper.RemoveTransfer(task.statepath);
+            bulkTaskTable.erase(id);
+        }
+
+        void cancelBulk(size_t id)
+        {
+            auto iter = bulkTaskTable.find(id);
+            if (iter == bulkTaskTable.end())
+            {
+                return ;
+            }
+
+            discardHandles([id](RequestTypeOption* opt){
+                return opt->type == RequestType::HttpBulk && ((DownloadBlock*) opt->data)->bulk == id;
+            });
+
+            BulkTask& task = iter->second;
+            for (auto& entry: task.items)
+            {
+                if (downloadHooks.erase(entry.filepath) > 0)
+                {
+                    cancelDownload(entry.filepath);
+                }
+                else
+                {
+                    hashWorker.Drop(entry.filepath);
+                }
+            }
+
+            if (task.statefd >= 0)
+            {
+                close(task.statefd);
+            }
+
+            bandwidthShaper.RemoveTransfer(task.statepath);
+            bulkTaskTable.erase(iter);
+        }
+
+        std::map<size_t, std::function<void(bool, std::vector<std::string>)>> bulkCallbackMap;
+        std::map<size_t, std::tuple<size_t, size_t, long long>> bulkProgressMap;
+
+        // =========================================
+        /* QueueDownload files: logged, then started in order while fewer than maxQueueActive run
+         * and their filesystem has room for what every running file still has to write */
+        DownloadQueueLog queueLog;
+        std::deque<QueuedDownload> downloadQueue;
+        std::map<std::string, long long> queueActive;
+        HttpOption queueOption;
+        long maxQueueActive = 4;
+        bool queueBlocked = false;
+        std::string queuePlanning;
+        bool queuePlanned = false;
+        size_t queuePlannedId = 0;
+        BlockList queuePlan;
+        bool queueSyncPending = false;
+
+        void openDownloadQueue(const std::string& dir, const HttpOption& opt, long max_active)
+        {
+            queueOption = opt;
+            maxQueueActive = max_active;
+
+            std::vector<QueuedDownload> pending;
+            queueLog.Close();
+            if (!queueLog.Open(dir, pending))
+            {
+                fprintf(stderr, "E: download queue %s: %s\n", dir.c_str(), strerror(errno));
+            }
+
+            /* the queue is rebuilt from the log, running files keep running and queued ones keep their ids */
+            std::map<std::string, size_t> known;
+            for (auto& entry: downloadQueue)
+            {
+                known[entry.filepath] = entry.id;
+            }
+            downloadQueue.clear();
+
+            for (auto iter = pending.begin(); iter != pending.end();)
+            {
+                if (queueActive.count(iter->filepath) > 0)
+                {
+                    iter = pending.erase(iter);
+                    continue;
+                }
+
+                auto id = known.find(iter->filepath);
+                iter->id = id != known.end() ? id->second : newIndex();
+                downloadQueue.push_back(*iter);
+                ++iter;
+            }
+
+            httpTaskManager.PushToForeground([this, pending](){
+                for (auto& entry: pending)
+                {
+                    downloadIdMap[entry.filepath] = entry.id;
+                }
+            });
+
+            syncDownloadQueue();
+        }
+
+        /* records of one batch of calls share a single fdatasync, the scheduler runs after it */
+        void syncDownloadQueue()
+        {
+            if (queueSyncPending)
+            {
+                return ;
+            }
+
+            queueSyncPending = true;
+            timerQueue.Push(0, [this](){
+                queueSyncPending = false;
+                queueLog.Sync();
+                scheduleDownloadQueue();
+            });
+        }
+
+        void queueDownload(const QueuedDownload& entry)
+        {
+            if (!queueLog.IsOpen())
+            {
+                fprintf(stderr, "E: download queue: not open, %s is not queued\n", entry.filepath.c_str());
+                std::string filepath = entry.filepath;
+                httpTaskManager.PushToForeground([this, filepath](){
+                    if (downloadQueueCallback != nullptr)
+                    {
+                        downloadQueueCallback(false, filepath);
+                    }
+
+                    downloadIdMap.erase(filepath);
+                });
+                return ;
+            }
+
+            /* a file already queued or running is not queued twice, a Cancel of either id cancels it */
+            auto same = [&entry](const QueuedDownload& item){ return item.filepath == entry.filepath; };
+            if (queueActive.count(entry.filepath) > 0
+                || std::find_if(downloadQueue.begin(), downloadQueue.end(), same) != downloadQueue.end())
+            {
+                return ;
+            }
+
+            queueLog.Queued(entry);
+            downloadQueue.push_back(entry);
+            syncDownloadQueue();
+        }
+
+        static long long freeDiskSpace(const std::string& filepath)
+        {
+            size_t slash = filepath.rfind('/');
+            std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : filepath.substr(0, slash);
+
+            struct statvfs st;
+            if (statvfs(dir.c_str(), &st) != 0)
+            {
+                return std::numeric_limits<long long>::max();
+            }
+
+            return (long long)st.f_bavail * (long long)st.f_frsize;
+        }
+
+        long long queueOutstanding()
+        {
+            long long outstanding = 0;
+            for (auto& active: queueActive)
+            {
+                outstanding += std::max(0LL, active.second - (long long)downloadDashboard.Size(active.first));
+            }
+
+            return outstanding;
+        }
+
+        /* the head is planned on the multi once, a head waiting for space keeps its plan */
+        void scheduleDownloadQueue()
+        {
+            if (downloadQueue.empty() || (long)queueActive.size() >= maxQueueActive || queueBlocked || !queuePlanning.empty())
+            {
+                return ;
+            }
+
+            QueuedDownload entry = downloadQueue.front();
+            if (queuePlanned && queuePlannedId == entry.id)
+            {
+                admitQueueHead();
+                return ;
+            }
+
+            std::vector<std::string> urls(1, entry.url);
+            queuePlanning = entry.filepath;
+
+            planDownload(urls, entry.filepath, queueOption, entry.blockSize, true, [this, entry](BlockList blockList){
+                queuePlanning.clear();
+                if (downloadQueue.empty() || downloadQueue.front().id != entry.id)
+                {
+                    scheduleDownloadQueue();
+                    return ;
+                }
+
+                queuePlanned = true;
+                queuePlannedId = entry.id;
+                queuePlan = blockList;
+                admitQueueHead();
+            });
+        }
+
+        void admitQueueHead()
+        {
+            QueuedDownload entry = downloadQueue.front();
+            long long planned = 0;
+            for (auto& block: queuePlan.all)
+            {
+                planned += std::max(0L, std::get<1>(block) - std::get<0>(block));
+            }
+
+            /* the head waits for space instead of being overtaken, the queue keeps its order.
+             * a file of unknown length still needs the reserve */
+            if (planned + queueOutstanding() + DOWNLOAD_QUEUE_DISK_RESERVE > freeDiskSpace(entry.filepath))
+            {
+                fprintf(stderr, "E: download queue: no space for %lld bytes of %s\n", planned, entry.filepath.c_str());
+                queueBlocked = true;
+                timerQueue.Push(DOWNLOAD_QUEUE_SPACE_RETRY_MS, [this](){
+                    queueBlocked = false;
+                    scheduleDownloadQueue();
+                });
+                return ;
+            }
+
+            BlockList blockList;
+            std::swap(blockList, queuePlan);
+            queuePlanned = false;
+
+            downloadQueue.pop_front();
+            startQueued(entry, blockList, planned);
+            scheduleDownloadQueue();
+        }
+
+        void startQueued(const QueuedDownload& entry, const BlockList& blockList, long long planned)
+        {
+            std::string filepath = entry.filepath;
+            queueActive[filepath] = planned;
+            downloadHooks[filepath] = [this, filepath](bool ok){
+                if (ok)
+                {
+                    FileTool::DowdloadFinish(filepath);
+                }
+                finishQueued(filepath, ok);
+            };
+
+            if (queueOption.maxRecvSpeed > 0)
+            {
+                bandwidthShaper.SetTransferLimit(filepath, queueOption.maxRecvSpeed);
+            }
+
+            if (blockList.all.empty())
+            {
+                downloadResultTable[filepath][0] = DownloadResult::Failed;
+            }
+            else
+            {
+                pushDownload(entry.id, std::vector<std::string>(1, entry.url), blockList, filepath, true, queueOption);
+            }
+
+            checkDownloadFinished(filepath);
+        }
+
+        /* a failed file stays pending in the log, the next SetDownloadQueue retries it */
+        void finishQueued(const std::string& filepath, bool ok)
+        {
+            queueActive.erase(filepath);
+            if (ok)
+            {
+                queueLog.Done(filepath);
+            }
+            syncDownloadQueue();
+
+            httpTaskManager.PushToForeground([this, ok, filepath](){
+                if (downloadQueueCallback != nullptr)
+                {
+                    downloadQueueCallback(ok, filepath);
+                }
+
+                downloadIdMap.erase(filepath);
+            });
+        }
+
+        void cancelQueued(const std::string& filepath)
+        {
+            /* the probe of a cancelled head was dropped with the download's handles */
+            if (queuePlanning == filepath)
+            {
+                queuePlanning.clear();
+            }
+
+            size_t queued = downloadQueue.size();
+            downloadQueue.erase(std::remove_if(downloadQueue.begin(), downloadQueue.end()
+                    , [&filepath](const QueuedDownload& entry){ return entry.filepath == filepath; }), downloadQueue.end());
+
+            if (queueActive.erase(filepath) > 0)
+            {
+                downloadHooks.erase(filepath);
+            }
+            else if (queued == downloadQueue.size())
+            {
+                return ;
+            }
+
+            queueLog.Done(filepath);
+            syncDownloadQueue();
+        }
+
+        std::function<void(bool, std::string)> downloadQueueCallback;
+
+        std::map<std::string, std::function<void(bool, std::string)>> downloadCallbackMap;
+        std::map<std::string, size_t> downloadIdMap;
+
+        std::map<std::string, UploadTask> uploadTaskTable;
+        std::deque<CURL*> waitUploadHandles;
+        curl_slist* uploadHeaders = nullptr;
+
+        std::map<std::string, std::function<void(bool, std::string, std::vector<std::string>)>> uploadCallbackMap;
+        std::map<std::string, size_t> uploadIdMap;
+
+        bool pushUpload(size_t id, const std::string& filepath, const UploadOption& upload, const HttpOption& opt
+                , size_t block_size, bool resume)
+        {
+            /* pushing the same file again replaces the upload in flight, which never calls back */
+            if (uploadTaskTable.count(filepath) > 0)
+            {
+                cancelUpload(filepath);
+            }
+
+            UploadTask& task = uploadTaskTable[filepath];
+            if (!mapUploadFile(filepath, task))
+            {
+                uploadTaskTable.erase(filepath);
+                return false;
+            }
+
+            task.id = id;
+            task.resume = resume;
+            task.upload = upload;
+            task.blockSize = block_size * 1024 * 1024;
+            task.retriesLeft = opt.retryBudget;
+            task.attempts.clear();
+            task.results.clear();
+            task.tags.clear();
+
+            std::string logfile = HttpClient::UploadLogFullPath(filepath);
+            if (resume)
+            {
+                task.tags = FileTool::LoadUploadParts(logfile, upload.uploadId);
+                if (task.tags.empty())
+                {
+                    FileTool::WriteUploadHeader(logfile, upload.uploadId);
+                }
+            }
+
+            if (uploadHeaders == nullptr)
+            {
+                uploadHeaders = curl_slist_append(uploadHeaders, "Content-Type:");
+                uploadHeaders = curl_slist_append(uploadHeaders, "Expect:");
+            }
+
+            /* caller headers replace uploadHeaders on the handle, so they carry the same two lines */
+            task.opt = opt;
+            if (!opt.headers.Empty())
+            {
+                task.opt.headers.Add("Content-Type", "");
+                task.opt.headers.Add("Expect", "");
+            }
+
+            size_t count = task.length == 0 ? 1 : (task.length + task.blockSize - 1) / task.blockSize;
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (task.tags.find(i) != task.tags.end())
+                {
+                    task.results[i] = DownloadResult::Succeed;
+                    continue;
+                }
+
+                waitUploadHandles.push_back(createUploadPart(filepath, task, i));
+                task.results[i] = DownloadResult::None;
+            }
+
+            /* a journal that lists every part has nothing left to send */
+            checkUploadFinished(filepath);
+            return true;
+        }
+
+        void checkUploadFinished(const std::string& filepath)
+        {
+            auto iter = uploadTaskTable.find(filepath);
+            if (iter == uploadTaskTable.end())
+            {
+                return ;
+            }
+
+            UploadTask& task = iter->second;
+            DownloadResult uploadResult = DownloadResult::Succeed;
+            for(auto res: task.results)
+            {
+                if (res.second == DownloadResult::None)
+                {
+                    uploadResult = DownloadResult::None;
+                    break;
+                }
+                else if (res.second == DownloadResult::Failed)
+                {
+                    uploadResult = DownloadResult::Failed;
+                }
+            }
+
+            if (uploadResult != DownloadResult::None)
+            {
+                bool succeed = uploadResult == DownloadResult::Succeed;
+                std::string path = filepath;
+                std::vector<std::string> tags;
+                for (auto tag: task.tags)
+                {
+                    tags.push_back(tag.second == "-" ? "" : tag.second);
+                }
+
+                if (succeed)
+                {
+                    std::string log_file_path = HttpClient::UploadLogFullPath(path);
+                    std::remove(log_file_path.c_str());
+                }
+
+                httpTaskManager.PushToForeground([this, succeed, path, tags](){
+                    auto callback = uploadCallbackMap[path];
+                    if (callback != nullptr)
+                    {
+                        callback(succeed, path, tags);
+                    }
+
+                    uploadCallbackMap.erase(path);
+                    uploadIdMap.erase(path);
+                });
+
+                unmapUploadFile(task);
+                uploadTaskTable.erase(iter);
+            }
+        }
+
+        /* parts are read from the mapping so the shaper can pause them like downloads */
+        static size_t uploadReadData(char *buffer, size_t size, size_t nitems, void *stream)
+        {
+            UploadBlock* block = (UploadBlock*)stream;
+            size_t length = std::min(size * nitems, block->length - block->sent);
+
+            if (length > 0 && !block->engine->bandwidthShaper.Acquire(block->handle, block->host, "", length))
+            {
+                return CURL_READFUNC_PAUSE;
+            }
+
+            memcpy(buffer, block->data + block->sent, length);
+            block->sent += length;
+
+            return length;
+        }
+
+        static int uploadSeekData(void *stream, curl_off_t offset, int origin)
+        {
+            UploadBlock* block = (UploadBlock*)stream;
+            if (origin != SEEK_SET || offset < 0 || (size_t)offset > block->length)
+            {
+                return CURL_SEEKFUNC_CANTSEEK;
+            }
+
+            block->sent = (size_t)offset;
+            return CURL_SEEKFUNC_OK;
+        }
+
+        CURL* createUploadPart(const std::string& filepath, UploadTask& task, size_t index)
+        {
+            size_t begin = index * task.blockSize;
+            size_t end = std::min(task.length, begin + task.blockSize);
+            std::string url = expandUploadUrl(task.upload, index + 1);
+
+            CURL* curl = curl_easy_init();
+            UploadBlock* block = takeUploadBlock(curl, index, task.resume, filepath);
+            block->engine = this;
+            block->host = urlHost(url);
+            block->data = task.data == nullptr ? "" : (const char*)task.data + begin;
+            block->length = end - begin;
+            RequestTypeOption* reqtype = takeRequestOption(RequestType::HttpUpload, block);
+
+            curl_easy_setopt(curl, CURLOPT_POST, 1L);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)block->length);
+            curl_easy_setopt(curl, CURLOPT_READFUNCTION, uploadReadData);
+            curl_easy_setopt(curl, CURLOPT_READDATA, block);
+            curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, uploadSeekData);
+            curl_easy_setopt(curl, CURLOPT_SEEKDATA, block);
+            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, task.upload.method.c_str());
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, uploadHeaders);
+            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, uploadHeaderData);
+            curl_easy_setopt(curl, CURLOPT_HEADERDATA, block);
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discardWriteData);
+            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(curl, CURLOPT_HEADER, 0L);
+            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(curl, CURLOPT_PRIVATE, reqtype);
+
+            setCurlOptEx(&curl, url, task.opt);
+
+            return curl;
+        }
+
+        bool retryUploadPart(const std::string& filepath, size_t index)
+        {
+            auto iter = uploadTaskTable.find(filepath);
+            if (iter == uploadTaskTable.end() || iter->second.retriesLeft <= 0)
+            {
+                return false;
+            }
+
+            UploadTask& task = iter->second;
+            --task.retriesLeft;
+            int attempt = task.attempts[index]++;
+            size_t id = task.id;
+
+            long ceiling = std::min(task.opt.retryMaxDelayMs, task.opt.retryBaseDelayMs << std::min(attempt, 20));
+            long delay = std::uniform_int_distribution<long>(0, std::max(0L, ceiling))(random);
+
+            timerQueue.Push(delay, [this, id, filepath, index]() {
+                auto iter = uploadTaskTable.find(filepath);
+                if (iter == uploadTaskTable.end() || iter->second.id != id)
+                {
+                    return ;
+                }
+
+                waitUploadHandles.push_back(createUploadPart(filepath, iter->second, index));
+            });
+
+            return true;
+        }
+
+        static size_t requestWriteData(void *ptr, size_t size, size_t nmemb, void *stream)
+        {
+            RequestStream* response = (RequestStream*)stream;
+            size_t length = size * nmemb;
+
+            response->body.append((const char*)ptr, length);
+            response->engine->bandwidthShaper.Consume(response->host, "", length);
+
+            return length;
+        }
+
+        /* each line is parsed as it arrives into the pooled stream, which keeps its buffers between requests */
+        static size_t requestHeaderData(char *ptr, size_t size, size_t nmemb, void *stream)
+        {
+            HttpResponseHeaders& headers = ((RequestStream*)stream)->headers;
+            size_t length = size * nmemb;
+
+            /* redirects and 100 Continue start over with a new status line */
+            if (length >= 5 && memcmp(ptr, "HTTP/", 5) == 0)
+            {
+                headers.raw.clear();
+                headers.fields.clear();
+                return length;
+            }
+
+            const char* colon = (const char*)memchr(ptr, ':', length);
+            if (colon == nullptr)
+            {
+                return length;
+            }
+
+            const char* value = colon + 1;
+            const char* end = ptr + length;
+            while (value < end && (*value == ' ' || *value == '\t'))
+            {
+                ++value;
+            }
+            while (end > value && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' ' || end[-1] == '\t'))
+            {
+                --end;
+            }
+
+            size_t begin = headers.raw.size();
+            size_t name_size = colon - ptr;
+            headers.raw.append(ptr, length);
+            headers.fields.push_back(HttpResponseHeaders::Field{headerNameHash(ptr, name_size), begin, name_size
+                    , begin + (value - ptr), (size_t)(end - value)});
+
+            return length;
+        }
+
+        /* ids whose callbacks take the response headers, hedged copies capture them too */
+        std::set<size_t> headerRequests;
+
+        void captureHeaders(CURL* curl, RequestStream* stream)
+        {
+            stream->headers.raw.clear();
+            stream->headers.fields.clear();
+            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, requestHeaderData);
+            curl_easy_setopt(curl, CURLOPT_HEADERDATA, stream);
+        }
+
+        std::map<size_t, std::string> postParamMap;
+
+        CURL* createHttpRequest(const std::string& url, size_t index, bool post, const std::string& params_str
+                , const HttpOption& opt)
+        {
+            CURL* curl = curl_easy_init();
+
+            RequestStream* stream = takeRequestStream(curl, index);
+            stream->engine = this;
+            stream->host = urlHost(url);
+            RequestTypeOption* reqtype = takeRequestOption(RequestType::HttpRequest, stream);
+
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, requestWriteData);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, stream);
+            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(curl, CURLOPT_HEADER, 0L);
+            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(curl, CURLOPT_PRIVATE, reqtype);
+
+            if (headerRequests.count(index) > 0)
+            {
+                captureHeaders(curl, stream);
+            }
+
+            if (opt.maxRecvSpeed > 0)
+            {
+                curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t)opt.maxRecvSpeed);
+            }
+
+            setCurlOptEx(&curl, url, opt);
+
+            if (post)
+            {
+                curl_easy_setopt(curl, CURLOPT_POST, 1L);
+                if (!params_str.empty())
+                {
+                    postParamMap[index] = params_str;
+                    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postParamMap[index].c_str());
+                }
+            }
+
+            return curl;
+        }
+
+        CURL* createRequestPrototype(const RequestTemplate::Impl& proto)
+        {
+            CURL* curl = curl_easy_init();
+
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, requestWriteData);
+            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(curl, CURLOPT_HEADER, 0L);
+            curl_easy_setopt(curl, CURLOPT_URL, proto.baseUrl.c_str());
+
+            if (proto.opt.maxRecvSpeed > 0)
+            {
+                curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t)proto.opt.maxRecvSpeed);
+            }
+
+            setCurlOptEx(&curl, proto.baseUrl, proto.opt);
+            curl_easy_setopt(curl, CURLOPT_RESOLVE, (curl_slist*)nullptr);
+
+            if (proto.post)
+            {
+                curl_easy_setopt(curl, CURLOPT_POST, 1L);
+            }
+
+            return curl;
+        }
+
+        /* a duplicate of the prototype only needs its own stream, url and body */
+        void pushTemplateRequest(const RequestTemplate::Impl& proto, size_t index, const std::string& path
+                , const std::string& body)
+        {
+            std::string url = proto.baseUrl + path;
+            if (proto.handle == nullptr)
+            {
+                pushHttpRequest(url, index, proto.post, body, proto.opt);
+                return ;
+            }
+
+            CURL* curl = curl_easy_duphandle(proto.handle);
+
+            RequestStream* stream = takeRequestStream(curl, index);
+            stream->engine = this;
+            stream->host = proto.host;
+            RequestTypeOption* reqtype = takeRequestOption(RequestType::HttpRequest, stream);
+
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, stream);
+            curl_easy_setopt(curl, CURLOPT_PRIVATE, reqtype);
+            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            reqtype->headers = proto.opt.headers.Shared();
+
+            if (headerRequests.count(index) > 0)
+            {
+                captureHeaders(curl, stream);
+            }
+
+            if (proto.post)
+            {
+                std::string& params = postParamMap[index];
+                params = body;
+                curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)params.size());
+                curl_easy_setopt(curl, CURLOPT_POSTFIELDS, params.c_str());
+            }
+            else if (proto.opt.hedge)
+            {
+                hedgeController.Add(index, url, proto.opt, curl);
+            }
+
+            waitRequestHandles.push_back(curl);
+        }
+
+        // =========================================
+        std::set<CURL*> activeHandles;
+
+        /* a handle that waited in a queue starts with the current resolve list, not the one it was built with */
+        void addToMulti(CURL* handle)
+        {
+            RequestTypeOption* reqtype = nullptr;
+            curl_easy_getinfo(handle, CURLINFO_PRIVATE, &reqtype);
+            if (reqtype != nullptr && reqtype->resolve != resolveList)
+            {
+                applyResolveList(handle, reqtype);
+            }
+
+            curl_multi_add_handle(curlm, handle);
+            activeHandles.insert(handle);
+
+            if (!clearedResolves.empty() && reqtype != nullptr)
+            {
+                clearedResolves.clear();
+                rebuildResolveList();
+            }
+        }
+
+        void removeFromMulti(CURL* handle)
+        {
+            curl_multi_remove_handle(curlm, handle);
+            activeHandles.erase(handle);
+        }
+
+        /* drops a queued or running handle without reporting it */
+        void discardHandle(CURL* handle)
+        {
+            RequestTypeOption* opt;
+            curl_easy_getinfo(handle, CURLINFO_PRIVATE, &opt);
+
+            bandwidthShaper.Forget(handle);
+            downloadSink.Forget(handle);
+            if (activeHandles.count(handle) > 0)
+            {
+                removeFromMulti(handle);
+            }
+
+            if (opt->type == RequestType::HttpDownload || opt->type == RequestType::HttpBulk)
+            {
+                downloadSink.Finish((DownloadBlock*) opt->data, nullptr);
+            }
+
+            if (opt->type == RequestType::HttpBulk)
+            {
+                --bulkTransfers;
+            }
+
+            putbackRequestOption(opt);
+            curl_easy_cleanup(handle);
+        }
+
+        void discardHandles(std::function<bool(RequestTypeOption*)> match)
+        {
+            std::vector<CURL*> matched;
+            auto take = [&matched, &match](std::deque<CURL*>& queue)
+            {
+                for (auto iter = queue.begin(); iter != queue.end();)
+                {
+                    RequestTypeOption* opt;
+                    curl_easy_getinfo(*iter, CURLINFO_PRIVATE, &opt);
+                    if (match(opt))
+                    {
+                        matched.push_back(*iter);
+                        iter = queue.erase(iter);
+                    }
+                    else
+                    {
+                        ++iter;
+                    }
+                }
+            };
+
+            take(waitRequestHandles);
+            take(waitDownloadHandles);
+            take(waitUploadHandles);
+
+            for (auto handle: activeHandles)
+            {
+                RequestTypeOption* opt;
+                curl_easy_getinfo(handle, CURLINFO_PRIVATE, &opt);
+                if (match(opt))
+                {
+                    matched.push_back(handle);
+                }
+            }
+
+            for (auto handle: matched)
+            {
+                discardHandle(handle);
+            }
+        }
+
+        HedgeController hedgeController;
+
+        void pushHttpRequest(const std::string& url, size_t index, bool post, const std::string& params_str
+                , const HttpOption& opt)
+        {
+            CURL* curl = createHttpRequest(url, index, post, params_str, opt);
+
+            if (opt.hedge && !post)
+            {
+                hedgeController.Add(index, url, opt, curl);
+            }
+
+            waitRequestHandles.push_back(curl);
+        }
+
+        std::map<size_t, std::function<void(long, std::string)>> httpResponseMap;
+        std::map<size_t, std::function<void(long, const HttpResponseHeaders&, std::string)>> httpHeaderResponseMap;
+
+        // =========================================
+        void cancelRequest(size_t id)
+        {
+            hedgeController.Remove(id);
+            discardHandles([id](RequestTypeOption* opt){
+                return opt->type == RequestType::HttpRequest && ((RequestStream*) opt->data)->id == id;
+            });
+            postParamMap.erase(id);
+            headerRequests.erase(id);
+        }
+
+        void cancelDownload(const std::string& filepath)
+        {
+            discardHandles([&filepath](RequestTypeOption* opt){
+                return (opt->type == RequestType::HttpDownload && ((DownloadBlock*) opt->data)->filepath == filepath)
+                        || (opt->type == RequestType::HttpProbe && ((LengthProbe*) opt->data)->filepath == filepath)
+                        || (opt->type == RequestType::HttpManifest && ((ManifestFetch*) opt->data)->filepath == filepath);
+            });
+            hashWorker.Drop(filepath);
+
+            cancelQueued(filepath);
+            downloadResultTable.erase(filepath);
+            downloadTaskTable.erase(filepath);
+            pendingDeltas.erase(filepath);
+            downloadDashboard.Remove(filepath);
+            bandwidthShaper.RemoveTransfer(filepath);
+        }
+
+        void cancelUpload(const std::string& filepath)
+        {
+            discardHandles([&filepath](RequestTypeOption* opt){
+                return opt->type == RequestType::HttpUpload && ((UploadBlock*) opt->data)->filepath == filepath;
+            });
+
+            auto iter = uploadTaskTable.find(filepath);
+            if (iter != uploadTaskTable.end())
+            {
+                unmapUploadFile(iter->second);
+                uploadTaskTable.erase(iter);
+            }
+        }
+
+        // =========================================
+        /* a HEAD per connection leaves resolved names and established connections in the multi caches;
+         * they wait for a request slot like requests and never open more connections than a host may keep */
+        void pushPrewarm(const std::string& url, long connections, const HttpOption& opt)
+        {
+            if (maxHostConnects > 0)
+            {
+                connections = std::min(connections, maxHostConnects);
+            }
+
+            for (long i = 0; i < connections; ++i)
+            {
+                CURL* curl = curl_easy_init();
+                RequestTypeOption* reqtype = takeRequestOption(RequestType::HttpPrewarm, nullptr);
+
+                curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+                curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+                curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+                curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+                curl_easy_setopt(curl, CURLOPT_HEADER, 0L);
+                curl_easy_setopt(curl, CURLOPT_PRIVATE, reqtype);
+                curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, i == 0 ? 0L : 1L);
+
+                setCurlOptEx(&curl, url, opt);
+
+                waitRequestHandles.push_back(curl);
+            }
+        }
+    };
+}
+
+// ==============================================
+
+void ftx::HttpEngine::Impl::StartUp(long max_connects)
+{
+    httpThreadAlive = true;
+    maxConnects = max_connects;
+    maxDownloadConnects = CONNECTS_FOR_DOWNLOAD;
+    reserveObjectPools();
+
+    httpTaskManager.PushToBackgroundThread([this]() {
+        curl_global_init(CURL_GLOBAL_ALL);
+        curlm = curl_multi_init();
+
+        curl_multi_setopt(curlm, CURLMOPT_MAXCONNECTS, maxConnects);
+        curl_multi_setopt(curlm, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        curl_multi_setopt(curlm, CURLMOPT_MAX_HOST_CONNECTIONS, maxHostConnects);
+        curl_multi_setopt(curlm, CURLMOPT_MAX_CONCURRENT_STREAMS, maxConcurrentStreams);
+
+        diskWriter.Start();
+        hashWorker.Start();
+    });
+
+    std::shared_ptr<Impl> self = shared_from_this();
+    std::thread http_thread([self](){
+        while(self->httpThreadAlive)
+        {
+            self->httpTaskManager.BackgroundLoop();
+            self->curlPerformLoop();
+        }
+
+        if (!self->httpThreadAlive)
+        {
+            curl_multi_cleanup(self->curlm);
+            self->curlm = nullptr;
+            self->hashWorker.Stop();
+            self->diskWriter.Stop();
+            self->writeBufferPool.Clear();
+            clearObjectPools();
+            self->clearResolveLists();
+            curl_slist_free_all(self->uploadHeaders);
+            self->uploadHeaders = nullptr;
+            curl_global_cleanup();
+        }
+    });
+
+    http_thread.detach();
+}
+
+void ftx::HttpEngine::Impl::ShutDown()
+{
+    httpThreadAlive = false;
+}
+
+void ftx::HttpEngine::Impl::Loop()
+{
+    httpTaskManager.ForegroundLoop();
+}
+
+size_t ftx::HttpEngine::Impl::PushDownload(const std::string& url, const std::string& filepath
+        , std::function<void(bool, std::string)> callback, size_t block_size, bool need_resume)
+{
+    HttpOption opt = defaultHttpOption(url);
+    return PushDownloadEx(url, filepath, opt, callback, block_size, need_resume);
+}
+
+size_t ftx::HttpEngine::Impl::PushDownloadEx(const std::string &url, const std::string &filepath, const HttpOption &opt
+        , std::function<void(bool, std::string)> callback, size_t block_size, bool need_resume)
+{
+    return PushDownloadMirrorsEx(std::vector<std::string>(1, url), filepath, opt, callback, block_size, need_resume);
+}
+
+size_t ftx::HttpEngine::Impl::PushDownloadMirrors(const std::vector<std::string> &urls, const std::string &filepath
+        , std::function<void(bool, std::string)> callback, size_t block_size, bool need_resume)
+{
+    HttpOption opt = defaultHttpOption(urls.empty() ? "" : urls[0]);
+    return PushDownloadMirrorsEx(urls, filepath, opt, callback, block_size, need_resume);
+}
+
+size_t ftx::HttpEngine::Impl::PushDownloadMirrorsEx(const std::vector<std::string> &urls, const std::string &filepath
+        , const HttpOption &opt, std::function<void(bool, std::string)> callback, size_t block_size, bool need_resume)
+{
+    size_t index = newIndex();
+    httpTaskManager.PushToBackgroundThread([=]() {
+        planDownload(urls, filepath, opt, block_size, need_resume, [=](BlockList blockList){
+            if (opt.maxRecvSpeed > 0)
+            {
+                bandwidthShaper.SetTransferLimit(filepath, opt.maxRecvSpeed);
+            }
+
+            //
+            if (!urls.empty())
+            {
+                pushDownload(index, urls, blockList, filepath, need_resume, opt);
+            }
+
+            if (blockList.all.empty())
+            {
+                downloadResultTable[filepath][0] = DownloadResult::Failed;
+            }
+            checkDownloadFinished(filepath);
+        });
+    });
+
+    downloadCallbackMap[filepath] = callback;
+    downloadIdMap[filepath] = index;
+
+    return index;
+}
+
+size_t ftx::HttpEngine::Impl::PushDownloadDelta(const std::string &url, const std::string &manifest_url
+        , const std::string &basepath, const std::string &filepath, std::function<void(bool, std::string)> callback)
+{
+    HttpOption opt = defaultHttpOption(url);
+    return PushDownloadDeltaEx(url, manifest_url, basepath, filepath, opt, callback);
+}
+
+size_t ftx::HttpEngine::Impl::PushDownloadDeltaEx(const std::string &url, const std::string &manifest_url
+        , const std::string &basepath, const std::string &filepath, const HttpOption &opt
+        , std::function<void(bool, std::string)> callback)
+{
+    size_t index = newIndex();
+    httpTaskManager.PushToBackgroundThread([=]() {
+        if (opt.maxRecvSpeed > 0)
+        {
+            bandwidthShaper.SetTransferLimit(filepath, opt.maxRecvSpeed);
+        }
+
+        pushDelta(index, url, manifest_url, basepath, filepath, opt);
+    });
+
+    downloadCallbackMap[filepath] = callback;
+    downloadIdMap[filepath] = index;
+
+    return index;
+}
+
+size_t ftx::HttpEngine::Impl::PushBulk(const std::vector<BulkItem> &items, const std::string &statepath
+        , std::function<void(bool, std::vector<std::string>)> callback, long long small_file_size)
+{
+    HttpOption opt = defaultHttpOption(items.empty() ? "" : items[0].url);
+    return PushBulkEx(items, statepath, opt, callback, small_file_size);
+}
+
+size_t ftx::HttpEngine::Impl::PushBulkEx(const std::vector<BulkItem> &items, const std::string &statepath, const HttpOption &opt
+        , std::function<void(bool, std::vector<std::string>)> callback, long long small_file_size)
+{
+    size_t index = newIndex();
+    httpTaskManager.PushToBackgroundThread([=]() {
+        if (opt.maxRecvSpeed > 0)
+        {
+            bandwidthShaper.SetTransferLimit(statepath, opt.maxRecvSpeed);
+        }
+
+        pushBulk(index, items, statepath, opt, small_file_size);
+    });
+
+    bulkCallbackMap[index] = callback;
+    bulkProgressMap[index] = std::make_tuple((size_t)0, items.size(), 0LL);
+
+    return index;
+}
+
+std::tuple<size_t, size_t, long long> ftx::HttpEngine::Impl::BulkProgress(size_t id)
+{
+    auto iter = bulkProgressMap.find(id);
+    if (iter == bulkProgressMap.end())
+    {
+        return std::make_tuple((size_t)0, (size_t)0, 0LL);
+    }
+
+    return iter->second;
+}
+
+void ftx::HttpEngine::Impl::SetDownloadQueue(const std::string &state_dir, const HttpOption &opt
+        , std::function<void(bool, std::string)> callback, long max_active_files)
+{
+    downloadQueueCallback = callback;
+    httpTaskManager.PushToBackgroundThread([=](){
+        openDownloadQueue(state_dir, opt, max_active_files);
+    });
+}
+
+size_t ftx::HttpEngine::Impl::QueueDownload(const std::string &url, const std::string &filepath, size_t block_size)
+{
+    size_t index = newIndex();
+    QueuedDownload entry = {index, url, filepath, block_size};
+    httpTaskManager.PushToBackgroundThread([=](){
+        queueDownload(entry);
+    });
+
+    downloadIdMap[filepath] = index;
+
+    return index;
+}
+
+size_t ftx::HttpEngine::Impl::PushUpload(const std::string &filepath, const UploadOption &upload
+        , std::function<void(bool, std::string, std::vector<std::string>)> callback, size_t block_size, bool need_resume)
+{
+    HttpOption opt = defaultHttpOption(upload.urlTemplate);
+    return PushUploadEx(filepath, upload, opt, callback, block_size, need_resume);
+}
+
+size_t ftx::HttpEngine::Impl::PushUploadEx(const std::string &filepath, const UploadOption &upload, const HttpOption &opt
+        , std::function<void(bool, std::string, std::vector<std::string>)> callback, size_t block_size, bool need_resume)
+{
+    size_t index = newIndex();
+    httpTaskManager.PushToBackgroundThread([=]() {
+        if (!pushUpload(index, filepath, upload, opt, block_size, need_resume))
+        {
+            httpTaskManager.PushToForeground([this, filepath](){
+                auto callback = uploadCallbackMap[filepath];
+                if (callback != nullptr)
+                {
+                    callback(false, filepath, std::vector<std::string>());
+                }
+
+                uploadCallbackMap.erase(filepath);
+                uploadIdMap.erase(filepath);
+            });
+        }
+    });
+
+    uploadCallbackMap[filepath] = callback;
+    uploadIdMap[filepath] = index;
+
+    return index;
+}
+
+void ftx::HttpEngine::Impl::ClearUpload(const std::string &filepath)
+{
+    std::string log_file_path = HttpClient::UploadLogFullPath(filepath);
+    std::remove(log_file_path.c_str());
+}
+
+double ftx::HttpEngine::Impl::DownloadSpeed(const std::string &filepath)
+{
+    return downloadDashboard.Speed(filepath);
+}
+
+double ftx::HttpEngine::Impl::DownloadSize(const std::string &filepath)
+{
+    return downloadDashboard.Size(filepath);
+}
+
+std::tuple<double, double> ftx::HttpEngine::Impl::DownloadSpeedAndSize(const std::string &filepath)
+{
+    return downloadDashboard.SpeedAndSize(filepath);
+}
+
+double ftx::HttpEngine::Impl::DownloadAllSpeed()
+{
+    return downloadDashboard.AllSpeed();
+}
+
+void ftx::HttpEngine::Impl::ClearDownload(const std::string &filepath)
+{
+    CancelDownload(filepath);
+    httpTaskManager.PushToBackgroundThread([=](){
+        FileTool::ClearTempAndLogFiles(filepath);
+    });
+}
+
+void ftx::HttpEngine::Impl::Cancel(size_t id)
+{
+    httpResponseMap.erase(id);
+    httpHeaderResponseMap.erase(id);
+
+    if (bulkCallbackMap.count(id) > 0)
+    {
+        bulkCallbackMap.erase(id);
+        bulkProgressMap.erase(id);
+        httpTaskManager.PushToBackgroundThread([=](){
+            cancelBulk(id);
+        });
+        return ;
+    }
+
+    for (auto& item: downloadIdMap)
+    {
+        if (item.second == id)
+        {
+            std::string filepath = item.first;
+            CancelDownload(filepath);
+            return ;
+        }
+    }
+
+    for (auto& item: uploadIdMap)
+    {
+        if (item.second == id)
+        {
+            std::string filepath = item.first;
+            uploadCallbackMap.erase(filepath);
+            uploadIdMap.erase(filepath);
+            httpTaskManager.PushToBackgroundThread([=](){
+                cancelUpload(filepath);
+            });
+            return ;
+        }
+    }
+
+    httpTaskManager.PushToBackgroundThread([=](){
+        cancelRequest(id);
+    });
+}
+
+void ftx::HttpEngine::Impl::CancelDownload(const std::string &filepath)
+{
+    downloadCallbackMap.erase(filepath);
+    downloadIdMap.erase(filepath);
+    httpTaskManager.PushToBackgroundThread([=](){
+        cancelDownload(filepath);
+    });
+}
+
+void ftx::HttpEngine::Impl::SetSpeedLimit(long long bytes_per_sec)
+{
+    httpTaskManager.PushToBackgroundThread([=](){
+        bandwidthShaper.SetGlobalLimit(bytes_per_sec);
+    });
+}
+
+void ftx::HttpEngine::Impl::SetHostSpeedLimit(const std::string &host, long long bytes_per_sec)
+{
+    std::string key = urlHost(host);
+    httpTaskManager.PushToBackgroundThread([=](){
+        bandwidthShaper.SetHostLimit(key, bytes_per_sec);
+    });
+}
+
+void ftx::HttpEngine::Impl::SetDownloadSpeedLimit(const std::string &filepath, long long bytes_per_sec)
+{
+    httpTaskManager.PushToBackgroundThread([=](){
+        /* a bucket only lives as long as its download, it is removed when the download ends */
+        bool active = downloadTaskTable.count(filepath) > 0 || pendingDeltas.count(filepath) > 0;
+        for (auto& bulk: bulkTaskTable)
+        {
+            active = active || bulk.second.statepath == filepath;
+        }
+
+        if (bytes_per_sec > 0 && active)
+        {
+            bandwidthShaper.SetTransferLimit(filepath, bytes_per_sec);
+        }
+        else
+        {
+            bandwidthShaper.RemoveTransfer(filepath);
+        }
+    });
+}
+
+void ftx::HttpEngine::Impl::SetHedgePolicy(const HedgePolicy &policy)
+{
+    httpTaskManager.PushToBackgroundThread([=](){
+        hedgeController.SetPolicy(policy);
+    });
+}
+
+void ftx::HttpEngine::Impl::SetMaxHostConnections(long max_host_connects)
+{
+    httpTaskManager.PushToBackgroundThread([=](){
+        maxHostConnects = max_host_connects;
+        if (curlm != nullptr)
+        {
+            curl_multi_setopt(curlm, CURLMOPT_MAX_HOST_CONNECTIONS, max_host_connects);
+        }
+    });
+}
+
+void ftx::HttpEngine::Impl::SetMaxConcurrentStreams(long max_streams)
+{
+    /* curl reads anything below 1 as 100, unlimited is left to the server's SETTINGS */
+    long streams = max_streams > 0 ? max_streams : (long)std::numeric_limits<int>::max();
+    httpTaskManager.PushToBackgroundThread([=](){
+        maxConcurrentStreams = streams;
+        if (curlm != nullptr)
+        {
+            curl_multi_setopt(curlm, CURLMOPT_MAX_CONCURRENT_STREAMS, streams);
+        }
+    });
+}
+
+void ftx::HttpEngine::Impl::SetMaxBulkTransfers(long max_transfers)
+{
+    long transfers = max_transfers > 0 ? max_transfers : std::numeric_limits<long>::max();
+    httpTaskManager.PushToBackgroundThread([=](){
+        maxBulkTransfers = transfers;
+    });
+}
+
+void ftx::HttpEngine::Impl::SetHostHttpVersion(const std::string &host, HttpVersion version)
+{
+    std::string key = urlHost(host);
+    httpTaskManager.PushToBackgroundThread([=](){
+        hostHttpVersion[key] = version;
+    });
+}
+
+void ftx::HttpEngine::Impl::SetHostUnixSocket(const std::string &host, const std::string &path, bool abstract)
+{
+    std::string key = urlHost(host);
+    httpTaskManager.PushToBackgroundThread([=](){
+        if (path.empty())
+        {
+            hostUnixSocket.erase(key);
+        }
+        else
+        {
+            hostUnixSocket[key] = std::make_tuple(path, abstract);
+        }
+    });
+}
+
+void ftx::HttpEngine::Impl::SetWriteBuffers(size_t buffer_size, size_t buffer_count)
+{
+    writeBufferPool.Init(buffer_size, buffer_count);
+}
+
+void ftx::HttpClient::SetObjectPoolCapacity(size_t capacity)
+{
+    blockPool.SetCapacity(capacity);
+    reqStreamPool.SetCapacity(capacity);
+    uploadBlockPool.SetCapacity(capacity);
+    requestOptionPool.SetCapacity(capacity);
+}
+
+size_t ftx::HttpClient::ObjectPoolMemory()
+{
+    return blockPool.Memory() + reqStreamPool.Memory() + uploadBlockPool.Memory() + requestOptionPool.Memory();
+}
+
+void ftx::HttpEngine::Impl::Prewarm(const std::vector<std::string> &urls, long connections_per_host)
+{
+    for (auto& url: urls)
+    {
+        HttpOption opt = defaultHttpOption(url);
+        PrewarmEx(url, opt, connections_per_host);
+    }
+}
+
+void ftx::HttpEngine::Impl::PrewarmEx(const std::string &url, const HttpOption &opt, long connections_per_host)
+{
+    httpTaskManager.PushToBackgroundThread([=](){
+        pushPrewarm(url, connections_per_host, opt);
+    });
+}
+
+void ftx::HttpEngine::Impl::AddResolve(const std::string &host, int port, const std::string &address)
+{
+    std::string entry = host + ":" + std::to_string(port) + ":" + address;
+    httpTaskManager.PushToBackgroundThread([=](){
+        resolveEntries.push_back(entry);
+        clearedResolves.erase(resolveKey(entry));
+        rebuildResolveList();
+    });
+}
+
+void ftx::HttpEngine::Impl::ClearResolve()
+{
+    httpTaskManager.PushToBackgroundThread([=](){
+        for (auto& entry: resolveEntries)
+        {
+            clearedResolves.insert(resolveKey(entry));
+        }
+
+        resolveEntries.clear();
+        rebuildResolveList();
+    });
+}
+
+std::string ftx::HttpClient::FilePath2TmpPath(const std::string &filepath)
+{
+    return filepath + TEMP_FILE_SUFFIX;
+}
+
+std::string ftx::HttpClient::FileLogFullPath(const std::string &filepath)
+{
+    return filepath + FILE_LOG_SUFFIX;
+}
+
+std::string ftx::HttpClient::UploadLogFullPath(const std::string &filepath)
+{
+    return filepath + UPLOAD_LOG_SUFFIX;
+}
+
+bool ftx::HttpClient::BuildDeltaManifest(const std::string &filepath, const std::string &manifest_path, long block_size)
+{
+    return DeltaTool::Build(filepath, manifest_path, block_size);
+}
+
+std::string ftx::HttpClient::FileHash(const std::string &filepath)
+{
+    return DeltaTool::Digest(filepath);
+}
+
+void ftx::HttpEngine::Impl::curlPerformLoop()
+{
+    CURLMsg* msg;
+    int handles, max_fd, msgs = -1;
+    long wait_timeout;
+    fd_set read_fd, write_fd, exec_fd;
+    struct timeval T;
+
+    bandwidthShaper.Resume();
+    downloadSink.ResumeWaiting();
+    timerQueue.PerformDue();
+
+    curl_multi_perform(curlm, &handles);
+
+    if(handles != 0)
+    {
+        FD_ZERO(&read_fd);
+        FD_ZERO(&write_fd);
+        FD_ZERO(&exec_fd);
+
+        if(curl_multi_fdset(curlm, &read_fd, &write_fd, &exec_fd, &max_fd))
+        {
+            fprintf(stderr, "E: curl_multi_fdset\n");
+            return;
+        }
+
+        if(curl_multi_timeout(curlm, &wait_timeout))
+        {
+            fprintf(stderr, "E: curl_multi_timeout\n");
+            return ;
+        }
+        if(wait_timeout == -1)
+            wait_timeout = 100;
+        if(bandwidthShaper.HasPaused() || downloadSink.HasWaiting())
+            wait_timeout = std::min(wait_timeout, PAUSED_WAIT_TIMEOUT);
+        if(timerQueue.NextTimeout() != -1)
+            wait_timeout = std::min(wait_timeout, timerQueue.NextTimeout());
+
+        if(max_fd == -1)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(wait_timeout));
+        }
+        else
+        {
+            T.tv_sec = wait_timeout / 1000;
+            T.tv_usec = (wait_timeout % 1000) * 1000;
+
+            if(0 > select(max_fd+1, &read_fd, &write_fd, &exec_fd, &T))
+            {
+                fprintf(stderr, "E: select(%i,,,,%li): %i: %s\n",
+                        max_fd+1, wait_timeout, errno, strerror(errno));
+                return;
+            }
+        }
+    }
+
+    while((msg = curl_multi_info_read(curlm, &msgs)))
+    {
+        CURL *e = msg->easy_handle;
+        RequestTypeOption* opt;
+        long responseCode;
+        curl_easy_getinfo(e, CURLINFO_PRIVATE, &opt);
+        curl_easy_getinfo(e, CURLINFO_RESPONSE_CODE, &responseCode);
+
+        RequestType type = opt->type;
+
+        bool success = responseCode >= 200 && responseCode < 300;
+
+        if (type == RequestType::HttpDownload)
+        {
+            DownloadBlock* block = (DownloadBlock*) opt->data;
+            curl_off_t already;
+            curl_easy_getinfo(block->handle, CURLINFO_SIZE_DOWNLOAD_T, &already);
+
+            downloadDashboard.UpdateInfo(block->filepath, block->index, 0, (double)already);
+
+            curl_off_t speed;
+            curl_easy_getinfo(block->handle, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+
+            success = success && msg->data.result == CURLE_OK;
+            releaseMirror(block, success, (double)speed);
+
+            std::string filepath = block->filepath;
+            size_t index = block->index;
+            long end = block->end;
+            bool retryable = !block->unranged;
+            std::shared_ptr<BlockSink> sink = block->sink;
+            auto task = downloadTaskTable.find(filepath);
+            size_t id = task == downloadTaskTable.end() ? 0 : task->second.id;
+
+            /* a retry starts after the bytes that reached the disk, received ones may have been lost on the way */
+            downloadSink.Finish(block, [=](bool flushed){
+                auto task = downloadTaskTable.find(filepath);
+                if (task == downloadTaskTable.end() || task->second.id != id)
+                {
+                    return ;
+                }
+
+                long start = sink->committed;
+                bool succeed = success && flushed;
+                if (!succeed && retryable && start < end && retryDownloadBlock(filepath, index, start, end))
+                {
+                    return ;
+                }
+
+                downloadResultTable[filepath][index] = succeed ? DownloadResult::Succeed: DownloadResult::Failed;
+
+                checkDownloadFinished(filepath);
+            });
+        }
+        else if (type == RequestType::HttpBulk)
+        {
+            DownloadBlock* block = (DownloadBlock*) opt->data;
+            success = success && msg->data.result == CURLE_OK;
+
+            size_t id = block->bulk;
+            size_t item = block->index;
+            long received = block->start;
+            --bulkTransfers;
+
+            downloadSink.Finish(block, [=](bool flushed){
+                completeBulkItem(id, item, success && flushed, received);
+            });
+        }
+        else if (type == RequestType::HttpProbe)
+        {
+            finishLengthProbe(e, opt, success && msg->data.result == CURLE_OK);
+        }
+        else if (type == RequestType::HttpManifest)
+        {
+            finishManifestFetch(opt, success && msg->data.result == CURLE_OK);
+        }
+        else if (type == RequestType::HttpRequest)
+        {
+            RequestStream* stream = (RequestStream*) opt->data;
+            size_t id = stream->id;
+
+            if (hedgeController.Complete(e, id, msg->data.result == CURLE_OK, [this, &handles](CURL* loser){
+                if (activeHandles.count(loser) > 0)
+                {
+                    --handles;
+                }
+                discardHandle(loser);
+            }))
+            {
+                std::string result = stream->body;
+
+                if (headerRequests.erase(id) > 0)
+                {
+                    /* the parsed headers move out of the pooled stream, copies of the task only share them */
+                    std::shared_ptr<HttpResponseHeaders> headers
+                            = std::make_shared<HttpResponseHeaders>(std::move(stream->headers));
+                    stream->headers.raw.clear();
+                    stream->headers.fields.clear();
+                    httpTaskManager.PushToForeground([this, responseCode, id, headers, result](){
+                        auto callback = httpHeaderResponseMap[id];
+                        if (callback != nullptr)
+                        {
+                            callback(responseCode, *headers, result);
+                        }
+
+                        httpHeaderResponseMap.erase(id);
+                    });
+                }
+                else
+                {
+                    httpTaskManager.PushToForeground([this, responseCode, id, result](){
+                        auto callback = httpResponseMap[id];
+                        if (callback != nullptr)
+                        {
+                            callback(responseCode, result);
+                        }
+
+                        httpResponseMap.erase(id);
+                    });
+                }
+
+                postParamMap.erase(id);
+            }
+        }
+        else if (type == RequestType::HttpUpload)
+        {
+            UploadBlock* block = (UploadBlock*) opt->data;
+            UploadTask& task = uploadTaskTable[block->filepath];
+
+            success = success && msg->data.result == CURLE_OK;
+            bool retried = !success && retryUploadPart(block->filepath, block->index);
+            task.results[block->index] = success ? DownloadResult::Succeed
+                    : retried ? DownloadResult::None : DownloadResult::Failed;
+
+            if (success)
+            {
+                task.tags[block->index] = block->tag;
+                if (block->resume)
+                {
+                    FileTool::AppendUploadPart(HttpClient::UploadLogFullPath(block->filepath), block->index, block->tag);
+                }
+            }
+
+            checkUploadFinished(block->filepath);
+        }
+
+        putbackRequestOption(opt);
+
+        removeFromMulti(e);
+        curl_easy_cleanup(e);
+        --handles;
+    }
+
+    handles -= bulkTransfers;
+    admitBulkItems();
+
+    while (handles < maxDownloadConnects && !waitDownloadHandles.empty())
+    {
+        CURL* curl = waitDownloadHandles.front();
+        waitDownloadHandles.pop_front();
+        assignMirror(curl);
+        addToMulti(curl);
+        ++handles;
+    }
+
+    while (handles < maxDownloadConnects && !waitUploadHandles.empty())
+    {
+        CURL* curl = waitUploadHandles.front();
+        waitUploadHandles.pop_front();
+        addToMulti(curl);
+        ++handles;
+    }
+
+    long counter  = 0;
+    while (handles < maxConnects && !waitRequestHandles.empty() && counter < maxConnects - maxDownloadConnects)
+    {
+        CURL* curl = waitRequestHandles.front();
+        waitRequestHandles.pop_front();
+        addToMulti(curl);
+        ++handles;
+        ++counter;
+
+        RequestTypeOption* opt;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, &opt);
+        if (opt->type == RequestType::HttpRequest)
+        {
+            hedgeController.Started(((RequestStream*) opt->data)->id);
+        }
+    }
+
+    /* a duplicate takes a request slot like any other request and never overtakes one that waits */
+    hedgeController.Check([this, &handles](size_t id, const std::string& url, const HttpOption& opt) -> CURL* {
+        if (handles >= maxConnects || !waitRequestHandles.empty())
+        {
+            return nullptr;
+        }
+
+        CURL* curl = createHttpRequest(url, id, false, "", opt);
+        addToMulti(curl);
+        ++handles;
+        return curl;
+    });
+}
+
+void ftx::HttpEngine::Impl::checkDownloadFinished(const std::string& filepath)
+{
+    DownloadResult downloadResult = DownloadResult::Succeed;
+    for(auto res: downloadResultTable[filepath])
+    {
+        if (res.second == DownloadResult::None)
+        {
+            downloadResult = DownloadResult::None;
+        }
+        else if (res.second == DownloadResult::Failed)
+        {
+            downloadResult = DownloadResult::Failed;
+        }
+    }
+
+    if (downloadResult != DownloadResult::None)
+    {
+        /* a hook gets the file still under its temp name and renames it once it accepts it */
+        bool succeed = downloadResult == DownloadResult::Succeed;
+        std::function<void(bool)> done;
+        auto hook = downloadHooks.find(filepath);
+        if (hook != downloadHooks.end())
+        {
+            done = hook->second;
+            downloadHooks.erase(hook);
+        }
+        else
+        {
+            if (succeed)
+            {
+                FileTool::DowdloadFinish(filepath);
+            }
+
+            httpTaskManager.PushToForeground([this, succeed, filepath](){
+                auto callback = downloadCallbackMap[filepath];
+                if (callback != nullptr)
+                {
+                    callback(succeed, filepath);
+                }
+
+                downloadCallbackMap.erase(filepath);
+                downloadIdMap.erase(filepath);
+            });
+        }
+
+        downloadResultTable.erase(filepath);
+        downloadTaskTable.erase(filepath);
+        downloadDashboard.Remove(filepath);
+        bandwidthShaper.RemoveTransfer(filepath);
+
+        if (done != nullptr)
+        {
+            done(succeed);
+        }
+    }
+}
+
+size_t ftx::HttpEngine::Impl::RequestGet(const std::string &url, std::function<void(long, std::string)> callback)
+{
+    HttpOption opt = defaultHttpOption(url);
+    return RequestGetEx(url, opt, callback);
+}
+
+size_t ftx::HttpEngine::Impl::RequestPost(const std::string &url, const std::string &params_str
+        , std::function<void(long, std::string)> callback)
+{
+    HttpOption opt = defaultHttpOption(url);
+    return RequestPostEx(url, opt, params_str, callback);
+}
+
+size_t ftx::HttpEngine::Impl::RequestGetEx(const std::string &url, const HttpOption &opt
+        , std::function<void(long, std::string)> callback)
+{
+    size_t index = newIndex();
+    httpTaskManager.PushToBackgroundThread([=](){
+        pushHttpRequest(url, index, false, "", opt);
+    });
+
+    httpResponseMap[index] = callback;
+
+    return index;
+}
+
+size_t ftx::HttpEngine::Impl::RequestPostEx(const std::string &url, const HttpOption &opt, const std::string &params_str
+        , std::function<void(long, std::string)> callback)
+{
+    size_t index = newIndex();
+    httpTaskManager.PushToBackgroundThread([=](){
+        pushHttpRequest(url, index, true, params_str, opt);
+    });
+
+    httpResponseMap[index] = callback;
+
+    return index;
+}
+
+std::shared_ptr<ftx::RequestTemplate::Impl> ftx::HttpEngine::Impl::CreateRequestTemplate(const std::string &base_url
+        , const HttpOption &opt, bool post)
+{
+    std::shared_ptr<RequestTemplate::Impl> proto = std::make_shared<RequestTemplate::Impl>();
+    proto->baseUrl = base_url;
+    proto->host = urlHost(base_url);
+    proto->opt = opt;
+    proto->post = post;
+
+    httpTaskManager.PushToBackgroundThread([this, proto](){
+        proto->handle = createRequestPrototype(*proto);
+    });
+
+    return proto;
+}
+
+size_t ftx::HttpEngine::Impl::RequestWithTemplate(const std::shared_ptr<RequestTemplate::Impl> &proto, const std::string &path
+        , const std::string &body, std::function<void(long, std::string)> callback)
+{
+    size_t index = newIndex();
+    if (proto == nullptr)
+    {
+        httpTaskManager.PushToForeground([callback](){
+            if (callback != nullptr)
+            {
+                callback(0, "");
+            }
+        });
+        return index;
+    }
+
+    httpTaskManager.PushToBackgroundThread([this, proto, path, body, index](){
+        pushTemplateRequest(*proto, index, path, body);
+    });
+
+    httpResponseMap[index] = callback;
+
+    return index;
+}
+
+size_t ftx::HttpEngine::Impl::RequestGetWithHeaders(const std::string &url, const HttpOption &opt
+        , std::function<void(long, const HttpResponseHeaders&, std::string)> callback)
+{
+    size_t index = newIndex();
+    httpTaskManager.PushToBackgroundThread([=](){
+        headerRequests.insert(index);
+        pushHttpRequest(url, index, false, "", opt);
+    });
+
+    httpHeaderResponseMap[index] = callback;
+
+    return index;
+}
+
+size_t ftx::HttpEngine::Impl::RequestPostWithHeaders(const std::string &url, const HttpOption &opt
+        , const std::string &params_str, std::function<void(long, const HttpResponseHeaders&, std::string)> callback)
+{
+    size_t index = newIndex();
+    httpTaskManager.PushToBackgroundThread([=](){
+        headerRequests.insert(index);
+        pushHttpRequest(url, index, true, params_str, opt);
+    });
+
+    httpHeaderResponseMap[index] = callback;
+
+    return index;
+}
+
+size_t ftx::HttpEngine::Impl::RequestWithTemplateHeaders(const std::shared_ptr<RequestTemplate::Impl> &proto
+        , const std::string &path, const std::string &body
+        , std::function<void(long, const HttpResponseHeaders&, std::string)> callback)
+{
+    size_t index = newIndex();
+    if (proto == nullptr)
+    {
+        httpTaskManager.PushToForeground([callback](){
+            if (callback != nullptr)
+            {
+                callback(0, HttpResponseHeaders(), "");
+            }
+        });
+        return index;
+    }
+
+    httpTaskManager.PushToBackgroundThread([this, proto, path, body, index](){
+        headerRequests.insert(index);
+        pushTemplateRequest(*proto, index, path, body);
+    });
+
+    httpHeaderResponseMap[index] = callback;
+
+    return index;
+}
+
+// ==============================================
+
+ftx::HttpEngine::HttpEngine()
+: impl(std::make_shared<Impl>())
+{
+
+}
+
+/* the curl thread holds its own reference and finishes the shutdown */
+ftx::HttpEngine::~HttpEngine()
+{
+    impl->ShutDown();
+}
+
+void ftx::HttpEngine::StartUp(long max_connects)
+{
+    impl->StartUp(max_connects);
+}
+
+void ftx::HttpEngine::ShutDown()
+{
+    impl->ShutDown();
+}
+
+void ftx::HttpEngine::Loop()
+{
+    impl->Loop();
+}
+
+size_t ftx::HttpEngine::PushDownload(const std::string &url, const std::string &filepath
+        , std::function<void(bool, std::string)> callback, size_t block_size, bool need_resume)
+{
+    return impl->PushDownload(url, filepath, callback, block_size, need_resume);
+}
+
+size_t ftx::HttpEngine::PushDownloadEx(const std::string &url, const std::string &filepath, const HttpOption &opt
+        , std::function<void(bool, std::string)> callback, size_t block_size, bool need_resume)
+{
+    return impl->PushDownloadEx(url, filepath, opt, callback, block_size, need_resume);
+}
+
+size_t ftx::HttpEngine::PushDownloadMirrors(const std::vector<std::string> &urls, const std::string &filepath
+        , std::function<void(bool, std::string)> callback, size_t block_size, bool need_resume)
+{
+    return impl->PushDownloadMirrors(urls, filepath, callback, block_size, need_resume);
+}
+
+size_t ftx::HttpEngine::PushDownloadMirrorsEx(const std::vector<std::string> &urls, const std::string &filepath
+        , const HttpOption &opt, std::function<void(bool, std::string)> callback, size_t block_size, bool need_resume)
+{
+    return impl->PushDownloadMirrorsEx(urls, filepath, opt, callback, block_size, need_resume);
+}
+
+size_t ftx::HttpEngine::PushDownloadDelta(const std::string &url, const std::string &manifest_url, const std::string &basepath
+        , const std::string &filepath, std::function<void(bool, std::string)> callback)
+{
+    return impl->PushDownloadDelta(url, manifest_url, basepath, filepath, callback);
+}
+
+size_t ftx::HttpEngine::PushDownloadDeltaEx(const std::string &url, const std::string &manifest_url, const std::string &basepath
+        , const std::string &filepath, const HttpOption &opt, std::function<void(bool, std::string)> callback)
+{
+    return impl->PushDownloadDeltaEx(url, manifest_url, basepath, filepath, opt, callback);
+}
+
+size_t ftx::HttpEngine::PushBulk(const std::vector<BulkItem> &items, const std::string &statepath
+        , std::function<void(bool, std::vector<std::string>)> callback, long long small_file_size)
+{
+    return impl->PushBulk(items, statepath, callback, small_file_size);
+}
+
+size_t ftx::HttpEngine::PushBulkEx(const std::vector<BulkItem> &items, const std::string &statepath, const HttpOption &opt
+        , std::function<void(bool, std::vector<std::string>)> callback, long long small_file_size)
+{
+    return impl->PushBulkEx(items, statepath, opt, callback, small_file_size);
+}
+
+std::tuple<size_t, size_t, long long> ftx::HttpEngine::BulkProgress(size_t id)
+{
+    return impl->BulkProgress(id);
+}
+
+void ftx::HttpEngine::SetDownloadQueue(const std::string &state_dir, const HttpOption &opt
+        , std::function<void(bool, std::string)> callback, long max_active_files)
+{
+    impl->SetDownloadQueue(state_dir, opt, callback, max_active_files);
+}
+
+size_t ftx::HttpEngine::QueueDownload(const std::string &url, const std::string &filepath, size_t block_size)
+{
+    return impl->QueueDownload(url, filepath, block_size);
+}
+
+size_t ftx::HttpEngine::PushUpload(const std::string &filepath, const UploadOption &upload
+        , std::function<void(bool, std::string, std::vector<std::string>)> callback, size_t block_size, bool need_resume)
+{
+    return impl->PushUpload(filepath, upload, callback, block_size, need_resume);
+}
+
+size_t ftx::HttpEngine::PushUploadEx(const std::string &filepath, const UploadOption &upload, const HttpOption &opt
+        , std::function<void(bool, std::string, std::vector<std::string>)> callback, size_t block_size, bool need_resume)
+{
+    return impl->PushUploadEx(filepath, upload, opt, callback, block_size, need_resume);
+}
+
+void ftx::HttpEngine::ClearUpload(const std::string &filepath)
+{
+    impl->ClearUpload(filepath);
+}
+
+double ftx::HttpEngine::DownloadSpeed(const std::string &filepath)
+{
+    return impl->DownloadSpeed(filepath);
+}
+
+double ftx::HttpEngine::DownloadSize(const std::string &filepath)
+{
+    return impl->DownloadSize(filepath);
+}
+
+std::tuple<double, double> ftx::HttpEngine::DownloadSpeedAndSize(const std::string &filepath)
+{
+    return impl->DownloadSpeedAndSize(filepath);
+}
+
+double ftx::HttpEngine::DownloadAllSpeed()
+{
+    return impl->DownloadAllSpeed();
+}
+
+void ftx::HttpEngine::ClearDownload(const std::string &filepath)
+{
+    impl->ClearDownload(filepath);
+}
+
+void ftx::HttpEngine::Cancel(size_t id)
+{
+    impl->Cancel(id);
+}
+
+void ftx::HttpEngine::CancelDownload(const std::string &filepath)
+{
+    impl->CancelDownload(filepath);
+}
+
+void ftx::HttpEngine::SetSpeedLimit(long long bytes_per_sec)
+{
+    impl->SetSpeedLimit(bytes_per_sec);
+}
+
+void ftx::HttpEngine::SetHostSpeedLimit(const std::string &host, long long bytes_per_sec)
+{
+    impl->SetHostSpeedLimit(host, bytes_per_sec);
+}
+
+void ftx::HttpEngine::SetDownloadSpeedLimit(const std::string &filepath, long long bytes_per_sec)
+{
+    impl->SetDownloadSpeedLimit(filepath, bytes_per_sec);
+}
+
+void ftx::HttpEngine::SetHedgePolicy(const HedgePolicy &policy)
+{
+    impl->SetHedgePolicy(policy);
+}
+
+void ftx::HttpEngine::SetWriteBuffers(size_t buffer_size, size_t buffer_count)
+{
+    impl->SetWriteBuffers(buffer_size, buffer_count);
+}
+
+void ftx::HttpEngine::SetMaxHostConnections(long max_host_connects)
+{
+    impl->SetMaxHostConnections(max_host_connects);
+}
+
+void ftx::HttpEngine::SetMaxConcurrentStreams(long max_streams)
+{
+    impl->SetMaxConcurrentStreams(max_streams);
+}
+
+void ftx::HttpEngine::SetMaxBulkTransfers(long max_transfers)
+{
+    impl->SetMaxBulkTransfers(max_transfers);
+}
+
+void ftx::HttpEngine::SetHostHttpVersion(const std::string &host, HttpVersion version)
+{
+    impl->SetHostHttpVersion(host, version);
+}
+
+void ftx::HttpEngine::SetHostUnixSocket(const std::string &host, const std::string &path, bool abstract)
+{
+    impl->SetHostUnixSocket(host, path, abstract);
+}
+
+void ftx::HttpEngine::Prewarm(const std::vector<std::string> &urls, long connections_per_host)
+{
+    impl->Prewarm(urls, connections_per_host);
+}
+
+void ftx::HttpEngine::PrewarmEx(const std::string &url, const HttpOption &opt, long connections_per_host)
+{
+    impl->PrewarmEx(url, opt, connections_per_host);
+}
+
+void ftx::HttpEngine::AddResolve(const std::string &host, int port, const std::string &address)
+{
+    impl->AddResolve(host, port, address);
+}
+
+void ftx::HttpEngine::ClearResolve()
+{
+    impl->ClearResolve();
+}
+
+size_t ftx::HttpEngine::RequestGet(const std::string &url, std::function<void(long, std::string)> callback)
+{
+    return impl->RequestGet(url, callback);
+}
+
+size_t ftx::HttpEngine::RequestPost(const std::string &url, const std::string &params_str
+        , std::function<void(long, std::string)> callback)
+{
+    return impl->RequestPost(url, params_str, callback);
+}
+
+size_t ftx::HttpEngine::RequestGetEx(const std::string &url, const HttpOption &opt
+        , std::function<void(long, std::string)> callback)
+{
+    return impl->RequestGetEx(url, opt, callback);
+}
 
-        opt.useSSL = url.substr(0, 5) == "https";
-        opt.verifyHost = opt.useSSL;
-        opt.verifyPeer = opt.useSSL;
-        opt.useHttp2 = opt.useSSL;
-        opt.userAgent = "ftxHttpClient";
+size_t ftx::HttpEngine::RequestPostEx(const std::string &url, const HttpOption &opt, const std::string &params_str
+        , std::function<void(long, std::string)> callback)
+{
+    return impl->RequestPostEx(url, opt, params_str, callback);
+}
 
-        return opt;
-    }
+ftx::RequestTemplate ftx::HttpEngine::CreateRequestTemplate(const std::string &base_url, const HttpOption &opt, bool post)
+{
+    RequestTemplate tpl;
+    tpl.impl = impl->CreateRequestTemplate(base_url, opt, post);
+    return tpl;
 }
 
-// ==============================================
+size_t ftx::HttpEngine::RequestWithTemplate(const RequestTemplate &tpl, const std::string &path, const std::string &body
+        , std::function<void(long, std::string)> callback)
+{
+    return impl->RequestWithTemplate(tpl.impl, path, body, callback);
+}
 
-void ftx::HttpClient::StartUp(long max_connects)
+size_t ftx::HttpEngine::RequestGetWithHeaders(const std::string &url, const HttpOption &opt
+        , std::function<void(long, const HttpResponseHeaders&, std::string)> callback)
 {
-    httpThreadAlive = true;
-    maxConnects = max_connects;
-    maxDownloadConnects = CONNECTS_FOR_DOWNLOAD;
+    return impl->RequestGetWithHeaders(url, opt, callback);
+}
 
-    httpTaskManager.PushToBackgroundThread([]() {
-        curl_global_init(CURL_GLOBAL_ALL);
-        curlm = curl_multi_init();
+size_t ftx::HttpEngine::RequestPostWithHeaders(const std::string &url, const HttpOption &opt, const std::string &params_str
+        , std::function<void(long, const HttpResponseHeaders&, std::string)> callback)
+{
+    return impl->RequestPostWithHeaders(url, opt, params_str, callback);
+}
 
-        curl_multi_setopt(curlm, CURLMOPT_MAXCONNECTS, maxConnects);
-        curl_multi_setopt(curlm, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
-    });
+size_t ftx::HttpEngine::RequestWithTemplateHeaders(const RequestTemplate &tpl, const std::string &path, const std::string &body
+        , std::function<void(long, const HttpResponseHeaders&, std::string)> callback)
+{
+    return impl->RequestWithTemplateHeaders(tpl.impl, path, body, callback);
+}
 
-    std::thread http_thread([&](){
-        while(httpThreadAlive)
-        {
-            httpTaskManager.BackgroundLoop();
-            curlPerformLoop();
-        }
+// ==============================================
 
-        if (!httpThreadAlive)
-        {
-            curl_multi_cleanup(curlm);
-            curl_global_cleanup();
-        }
-    });
+/* never destroyed, so the static api stays usable while other statics are torn down at exit */
+ftx::HttpEngine& ftx::HttpClient::Default()
+{
+    static HttpEngine* engine = new HttpEngine();
+    return *engine;
+}
 
-    http_thread.detach();
+void ftx::HttpClient::StartUp(long max_connects)
+{
+    Default().StartUp(max_connects);
 }
 
 void ftx::HttpClient::ShutDown()
 {
-    httpThreadAlive = false;
-    clearDownloadBlockPool();
-    clearRequestOptionPool();
+    Default().ShutDown();
 }
 
 void ftx::HttpClient::Loop()
 {
-    httpTaskManager.ForegroundLoop();
+    Default().Loop();
 }
 
-void ftx::HttpClient::PushDownload(const std::string& url, const std::string& filepath
+size_t ftx::HttpClient::PushDownload(const std::string &url, const std::string &filepath
         , std::function<void(bool, std::string)> callback, size_t block_size, bool need_resume)
 {
-    HttpOption opt = defaultHttpOption(url);
-    PushDownloadEx(url, filepath, opt, callback, block_size, need_resume);
+    return Default().PushDownload(url, filepath, callback, block_size, need_resume);
 }
 
-void ftx::HttpClient::PushDownloadEx(const std::string &url, const std::string &filepath, const HttpOption &opt
+size_t ftx::HttpClient::PushDownloadEx(const std::string &url, const std::string &filepath, const HttpOption &opt
         , std::function<void(bool, std::string)> callback, size_t block_size, bool need_resume)
 {
-    httpTaskManager.PushToBackgroundThread([=]() {
-        BlockList blockList;
-
-        auto recomputaion = [url, block_size, opt]() -> BlockList
-        {
-            BlockList blockList;
-            size_t block_size_byte = block_size * 1024 * 1024;
-
-            long filesize = getDownloadFileLength(url.c_str(), opt);
-            long begin = 0;
-            while (begin < filesize)
-            {
-                long end = std::min(filesize, (long)(begin + block_size_byte));
-                blockList.all.push_back(std::make_tuple(begin, end));
-                begin += block_size_byte;
-            }
-
-            return blockList;
-        };
-
-        if (need_resume)
-        {
-            std::string logfile = FileLogFullPath(filepath);
-            blockList = FileTool::LoadBlocks(logfile);
-            if (blockList.all.empty())
-            {
-                blockList = recomputaion();
-                FileTool::WriteBlocks(logfile, blockList);
-            }
-        }
-        else
-        {
-            blockList = recomputaion();
-        }
+    return Default().PushDownloadEx(url, filepath, opt, callback, block_size, need_resume);
+}
 
-        //
-        pushDownload(url, blockList, filepath, need_resume, opt);
-    });
+size_t ftx::HttpClient::PushDownloadMirrors(const std::vector<std::string> &urls, const std::string &filepath
+        , std::function<void(bool, std::string)> callback, size_t block_size, bool need_resume)
+{
+    return Default().PushDownloadMirrors(urls, filepath, callback, block_size, need_resume);
+}
 
-    downloadCallbackMap[filepath] = callback;
+size_t ftx::HttpClient::PushDownloadMirrorsEx(const std::vector<std::string> &urls, const std::string &filepath
+        , const HttpOption &opt, std::function<void(bool, std::string)> callback, size_t block_size, bool need_resume)
+{
+    return Default().PushDownloadMirrorsEx(urls, filepath, opt, callback, block_size, need_resume);
 }
 
-double ftx::HttpClient::DownloadSpeed(const std::string &filepath)
+size_t ftx::HttpClient::PushDownloadDelta(const std::string &url, const std::string &manifest_url, const std::string &basepath
+        , const std::string &filepath, std::function<void(bool, std::string)> callback)
 {
-    return downloadDashboard.Speed(filepath);
+    return Default().PushDownloadDelta(url, manifest_url, basepath, filepath, callback);
 }
 
-double ftx::HttpClient::DownloadSize(const std::string &filepath)
+size_t ftx::HttpClient::PushDownloadDeltaEx(const std::string &url, const std::string &manifest_url, const std::string &basepath
+        , const std::string &filepath, const HttpOption &opt, std::function<void(bool, std::string)> callback)
 {
-    return downloadDashboard.Size(filepath);
+    return Default().PushDownloadDeltaEx(url, manifest_url, basepath, filepath, opt, callback);
 }
 
-std::tuple<double, double> ftx::HttpClient::DownloadSpeedAndSize(const std::string &filepath)
+size_t ftx::HttpClient::PushBulk(const std::vector<BulkItem> &items, const std::string &statepath
+        , std::function<void(bool, std::vector<std::string>)> callback, long long small_file_size)
 {
-    return downloadDashboard.SpeedAndSize(filepath);
+    return Default().PushBulk(items, statepath, callback, small_file_size);
 }
 
-double ftx::HttpClient::DownloadAllSpeed()
+size_t ftx::HttpClient::PushBulkEx(const std::vector<BulkItem> &items, const std::string &statepath, const HttpOption &opt
+        , std::function<void(bool, std::vector<std::string>)> callback, long long small_file_size)
 {
-    return downloadDashboard.AllSpeed();
+    return Default().PushBulkEx(items, statepath, opt, callback, small_file_size);
 }
 
-void ftx::HttpClient::ClearDownload(const std::string &filepath)
+std::tuple<size_t, size_t, long long> ftx::HttpClient::BulkProgress(size_t id)
 {
-    FileTool::ClearTempAndLogFiles(filepath);
+    return Default().BulkProgress(id);
 }
 
-std::string ftx::HttpClient::FilePath2TmpPath(const std::string &filepath)
+void ftx::HttpClient::SetDownloadQueue(const std::string &state_dir, const HttpOption &opt
+        , std::function<void(bool, std::string)> callback, long max_active_files)
 {
-    return filepath + TEMP_FILE_SUFFIX;
+    Default().SetDownloadQueue(state_dir, opt, callback, max_active_files);
 }
 
-std::string ftx::HttpClient::FileLogFullPath(const std::string &filepath)
+size_t ftx::HttpClient::QueueDownload(const std::string &url, const std::string &filepath, size_t block_size)
 {
-    return filepath + FILE_LOG_SUFFIX;
+    return Default().QueueDownload(url, filepath, block_size);
 }
 
-void ftx::HttpClient::curlPerformLoop()
+size_t ftx::HttpClient::PushUpload(const std::string &filepath, const UploadOption &upload
+        , std::function<void(bool, std::string, std::vector<std::string>)> callback, size_t block_size, bool need_resume)
 {
-    CURLMsg* msg;
-    int handles, max_fd, msgs = -1;
-    long wait_timeout;
-    fd_set read_fd, write_fd, exec_fd;
-    struct timeval T;
+    return Default().PushUpload(filepath, upload, callback, block_size, need_resume);
+}
 
-    curl_multi_perform(curlm, &handles);
+size_t ftx::HttpClient::PushUploadEx(const std::string &filepath, const UploadOption &upload, const HttpOption &opt
+        , std::function<void(bool, std::string, std::vector<std::string>)> callback, size_t block_size, bool need_resume)
+{
+    return Default().PushUploadEx(filepath, upload, opt, callback, block_size, need_resume);
+}
 
-    if(handles != 0)
-    {
-        FD_ZERO(&read_fd);
-        FD_ZERO(&write_fd);
-        FD_ZERO(&exec_fd);
+void ftx::HttpClient::ClearUpload(const std::string &filepath)
+{
+    Default().ClearUpload(filepath);
+}
 
-        if(curl_multi_fdset(curlm, &read_fd, &write_fd, &exec_fd, &max_fd))
-        {
-            fprintf(stderr, "E: curl_multi_fdset\n");
-            return;
-        }
+double ftx::HttpClient::DownloadSpeed(const std::string &filepath)
+{
+    return Default().DownloadSpeed(filepath);
+}
 
-        if(curl_multi_timeout(curlm, &wait_timeout))
-        {
-            fprintf(stderr, "E: curl_multi_timeout\n");
-            return ;
-        }
-        if(wait_timeout == -1)
-            wait_timeout = 100;
+double ftx::HttpClient::DownloadSize(const std::string &filepath)
+{
+    return Default().DownloadSize(filepath);
+}
 
-        if(max_fd == -1)
-        {
-            std::this_thread::sleep_for(std::chrono::milliseconds(wait_timeout));
-        }
-        else
-        {
-            T.tv_sec = wait_timeout / 1000;
-            T.tv_usec = (wait_timeout % 1000) * 1000;
+std::tuple<double, double> ftx::HttpClient::DownloadSpeedAndSize(const std::string &filepath)
+{
+    return Default().DownloadSpeedAndSize(filepath);
+}
 
-            if(0 > select(max_fd+1, &read_fd, &write_fd, &exec_fd, &T))
-            {
-                fprintf(stderr, "E: select(%i,,,,%li): %i: %s\n",
-                        max_fd+1, wait_timeout, errno, strerror(errno));
-                return;
-            }
-        }
-    }
+double ftx::HttpClient::DownloadAllSpeed()
+{
+    return Default().DownloadAllSpeed();
+}
 
-    while((msg = curl_multi_info_read(curlm, &msgs)))
-    {
-        CURL *e = msg->easy_handle;
-        RequestTypeOption* opt;
-        long responseCode;
-        curl_easy_getinfo(e, CURLINFO_PRIVATE, &opt);
-        curl_easy_getinfo(e, CURLINFO_RESPONSE_CODE, &responseCode);
+void ftx::HttpClient::ClearDownload(const std::string &filepath)
+{
+    Default().ClearDownload(filepath);
+}
 
-        RequestType type = opt->type;
+void ftx::HttpClient::Cancel(size_t id)
+{
+    Default().Cancel(id);
+}
 
-        bool success = responseCode >= 200 && responseCode < 300;
+void ftx::HttpClient::CancelDownload(const std::string &filepath)
+{
+    Default().CancelDownload(filepath);
+}
 
-        if (type == RequestType::HttpDownload)
-        {
-            DownloadBlock* block = (DownloadBlock*) opt->data;
-            double already;
-            curl_easy_getinfo(block->handle, CURLINFO_SIZE_DOWNLOAD, &already);
+void ftx::HttpClient::SetSpeedLimit(long long bytes_per_sec)
+{
+    Default().SetSpeedLimit(bytes_per_sec);
+}
 
-            downloadDashboard.UpdateInfo(block->filepath, block->index, 0, already);
+void ftx::HttpClient::SetHostSpeedLimit(const std::string &host, long long bytes_per_sec)
+{
+    Default().SetHostSpeedLimit(host, bytes_per_sec);
+}
 
-            downloadResultTable[block->filepath][block->index] = success ? DownloadResult::Succeed: DownloadResult::Failed;
+void ftx::HttpClient::SetDownloadSpeedLimit(const std::string &filepath, long long bytes_per_sec)
+{
+    Default().SetDownloadSpeedLimit(filepath, bytes_per_sec);
+}
 
-            DownloadResult downloadResult = DownloadResult::Succeed;
-            for(auto res: downloadResultTable[block->filepath])
-            {
-                if (res.second == DownloadResult::None)
-                {
-                    downloadResult = DownloadResult::None;
-                }
-                else if (res.second == DownloadResult::Failed)
-                {
-                    downloadResult = DownloadResult::Failed;
-                }
-            }
+void ftx::HttpClient::SetHedgePolicy(const HedgePolicy &policy)
+{
+    Default().SetHedgePolicy(policy);
+}
 
-            if (downloadResult != DownloadResult::None)
-            {
-                if (downloadResult == DownloadResult::Succeed)
-                {
-                    FileTool::DowdloadFinish(block->filepath);
-                }
+void ftx::HttpClient::SetWriteBuffers(size_t buffer_size, size_t buffer_count)
+{
+    Default().SetWriteBuffers(buffer_size, buffer_count);
+}
 
-                bool succeed = downloadResult == DownloadResult::Succeed;
-                std::string filepath = block->filepath;
-                httpTaskManager.PushToForeground([succeed, filepath](){
-                    auto callback = downloadCallbackMap[filepath];
-                    if (callback != nullptr)
-                    {
-                        callback(succeed, filepath);
-                    }
+void ftx::HttpClient::SetMaxHostConnections(long max_host_connects)
+{
+    Default().SetMaxHostConnections(max_host_connects);
+}
 
-                    downloadCallbackMap.erase(filepath);
-                });
+void ftx::HttpClient::SetMaxConcurrentStreams(long max_streams)
+{
+    Default().SetMaxConcurrentStreams(max_streams);
+}
 
-                downloadResultTable.erase(block->filepath);
-                downloadDashboard.Remove(block->filepath);
-            }
-        }
-        else if (type == RequestType::HttpRequest)
-        {
-            RequestStream* stream = (RequestStream*) opt->data;
-            size_t id = stream->id;
-            stream->stream.flush();
-            std::string result = stream->stream.str();
+void ftx::HttpClient::SetMaxBulkTransfers(long max_transfers)
+{
+    Default().SetMaxBulkTransfers(max_transfers);
+}
 
-            httpTaskManager.PushToForeground([responseCode, id, result](){
-                auto callback = httpResponseMap[id];
-                if (callback != nullptr)
-                {
-                    callback(responseCode, result);
-                }
+void ftx::HttpClient::SetHostHttpVersion(const std::string &host, HttpVersion version)
+{
+    Default().SetHostHttpVersion(host, version);
+}
 
-                httpResponseMap.erase(id);
-            });
+void ftx::HttpClient::SetHostUnixSocket(const std::string &host, const std::string &path, bool abstract)
+{
+    Default().SetHostUnixSocket(host, path, abstract);
+}
 
-            postParamMap.erase(id);
-        }
+void ftx::HttpClient::Prewarm(const std::vector<std::string> &urls, long connections_per_host)
+{
+    Default().Prewarm(urls, connections_per_host);
+}
 
-        putbackRequestOption(opt);
+void ftx::HttpClient::PrewarmEx(const std::string &url, const HttpOption &opt, long connections_per_host)
+{
+    Default().PrewarmEx(url, opt, connections_per_host);
+}
 
-        curl_multi_remove_handle(curlm, e);
-        curl_easy_cleanup(e);
-        --handles;
-    }
+void ftx::HttpClient::AddResolve(const std::string &host, int port, const std::string &address)
+{
+    Default().AddResolve(host, port, address);
+}
 
-    while (handles < maxDownloadConnects && !waitDownloadHandles.empty())
-    {
-        CURL* curl = waitDownloadHandles.front();
-        waitDownloadHandles.pop_front();
-        curl_multi_add_handle(curlm, curl);
-        ++handles;
-    }
+void ftx::HttpClient::ClearResolve()
+{
+    Default().ClearResolve();
+}
 
-    size_t counter  = 0;
-    while (handles < maxConnects && !waitRequestHandles.empty() && counter < maxConnects - maxDownloadConnects)
-    {
-        CURL* curl = waitRequestHandles.front();
-        waitRequestHandles.pop_front();
-        curl_multi_add_handle(curlm, curl);
-        ++handles;
-        ++counter;
-    }
+size_t ftx::HttpClient::RequestGet(const std::string &url, std::function<void(long, std::string)> callback)
+{
+    return Default().RequestGet(url, callback);
 }
 
-void ftx::HttpClient::RequestGet(const std::string &url, std::function<void(long, std::string)> callback)
+size_t ftx::HttpClient::RequestPost(const std::string &url, const std::string &params_str
+        , std::function<void(long, std::string)> callback)
 {
-    HttpOption opt = defaultHttpOption(url);
-    RequestGetEx(url, opt, callback);
+    return Default().RequestPost(url, params_str, callback);
 }
 
-void ftx::HttpClient::RequestPost(const std::string &url, const std::string &params_str
+size_t ftx::HttpClient::RequestGetEx(const std::string &url, const HttpOption &opt
         , std::function<void(long, std::string)> callback)
 {
-    HttpOption opt = defaultHttpOption(url);
-    RequestPostEx(url, opt, params_str, callback);
+    return Default().RequestGetEx(url, opt, callback);
 }
 
-void ftx::HttpClient::RequestGetEx(const std::string &url, const HttpOption &opt
+size_t ftx::HttpClient::RequestPostEx(const std::string &url, const HttpOption &opt, const std::string &params_str
         , std::function<void(long, std::string)> callback)
 {
-    size_t index = newIndex();
-    httpTaskManager.PushToBackgroundThread([=](){
-        pushHttpRequest(url, index, false, "", opt);
-    });
+    return Default().RequestPostEx(url, opt, params_str, callback);
+}
 
-    httpResponseMap[index] = callback;
+ftx::RequestTemplate ftx::HttpClient::CreateRequestTemplate(const std::string &base_url, const HttpOption &opt, bool post)
+{
+    return Default().CreateRequestTemplate(base_url, opt, post);
 }
 
-void ftx::HttpClient::RequestPostEx(const std::string &url, const HttpOption &opt, const std::string &params_str
+size_t ftx::HttpClient::RequestWithTemplate(const RequestTemplate &tpl, const std::string &path, const std::string &body
         , std::function<void(long, std::string)> callback)
 {
-    size_t index = newIndex();
-    httpTaskManager.PushToBackgroundThread([=](){
-        pushHttpRequest(url, index, true, params_str, opt);
-    });
+    return Default().RequestWithTemplate(tpl, path, body, callback);
+}
 
-    httpResponseMap[index] = callback;
+size_t ftx::HttpClient::RequestGetWithHeaders(const std::string &url, const HttpOption &opt
+        , std::function<void(long, const HttpResponseHeaders&, std::string)> callback)
+{
+    return Default().RequestGetWithHeaders(url, opt, callback);
+}
+
+size_t ftx::HttpClient::RequestPostWithHeaders(const std::string &url, const HttpOption &opt, const std::string &params_str
+        , std::function<void(long, const HttpResponseHeaders&, std::string)> callback)
+{
+    return Default().RequestPostWithHeaders(url, opt, params_str, callback);
 }
 
-bool ftx::HttpClient::httpThreadAlive = false;
-long ftx::HttpClient::maxConnects = 20;
-long ftx::HttpClient::maxDownloadConnects = 10;
\ No newline at end of file
+size_t ftx::HttpClient::RequestWithTemplateHeaders(const RequestTemplate &tpl, const std::string &path, const std::string &body
+        , std::function<void(long, const HttpResponseHeaders&, std::string)> callback)
+{
+    return Default().RequestWithTemplateHeaders(tpl, path, body, callback);
+}
@@ -7,6 +7,10 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <tuple>
+#include <functional>
+#include <memory>
 
 
 namespace ftx {
@@ -25,6 +29,40 @@ private:
     std::map<std::string, std::string> _params;
 };
 
+/* request headers, the curl list is built once and shared by every copy of the option holding it */
+class HttpHeaders
+{
+public:
+    class List;
+
+    /* an empty value removes a header libcurl would send by itself, e.g. Add("Expect", "") */
+    void Add(const std::string& name, const std::string& value);
+    bool Empty() const { return list == nullptr; }
+    const std::shared_ptr<List>& Shared() const { return list; }
+
+private:
+    std::shared_ptr<List> list;
+};
+
+/* a view into a buffer owned by someone else, std::string_view is not in C++11 */
+struct HeaderView
+{
+    const char* data = nullptr;
+    size_t size = 0;
+
+    bool Empty() const { return size == 0; }
+    std::string ToString() const { return std::string(data, size); }
+};
+
+//
+enum class HttpVersion
+{
+    Default,              /* HTTP/2 when the server agrees, HTTP/1.1 otherwise */
+    Http1_1,
+    Http2,                /* HTTP/2 over TLS, HTTP/1.1 for cleartext */
+    Http2PriorKnowledge,  /* h2c, cleartext HTTP/2 without upgrade */
+};
+
 //
 struct HttpOption
 {
@@ -35,49 +73,384 @@ struct HttpOption
     bool verifyPeer;
     bool verifyHost;
     bool useHttp2;
+    long long maxRecvSpeed = 0; /* bytes per second, 0 means unlimited */
+    bool hedge = false; /* GET only, see HedgePolicy */
+    std::string hedgeHost; /* "host[:port]" the hedged copy is sent to, empty means the same url */
+    HttpVersion httpVersion = HttpVersion::Default; /* SetHostHttpVersion() takes precedence */
+    bool multiplexBlocks = true; /* false gives every download block its own HTTP/1.1 connection */
+    std::string unixSocketPath; /* connect through this unix domain socket instead of TCP, SetHostUnixSocket() takes precedence */
+    bool abstractSocket = false; /* unixSocketPath is a name in the Linux abstract namespace, without the leading NUL */
+    long connectTimeoutMs = 0; /* 0 means the libcurl default */
+    long timeoutMs = 0; /* whole transfer, per block for downloads, 0 means none */
+    long lowSpeedLimit = 0; /* bytes per second, aborts below it for lowSpeedTime seconds */
+    long lowSpeedTime = 0;
+    int retryBudget = 8; /* failed download blocks retried per file */
+    long retryBaseDelayMs = 500;
+    long retryMaxDelayMs = 30000;
+    HttpHeaders headers;
+};
+
+class HttpResponseHeaders;
+
+//
+struct HedgePolicy
+{
+    double percentile = 0.95; /* a copy is sent once a request is slower than this latency percentile of its host */
+    double maxHedgeRatio = 0.05; /* copies sent / hedgeable requests */
+    long minDelayMs = 5;
+    long defaultDelayMs = 50; /* used until enough latency samples are collected */
+};
+
+//
+struct UploadOption
+{
+    std::string urlTemplate; /* "{part}" and "{upload_id}" are replaced per part, e.g. "...?partNumber={part}&uploadId={upload_id}" */
+    std::string uploadId;
+    std::string method = "PUT";
+};
+
+//
+struct BulkItem
+{
+    std::string url;
+    std::string filepath;
+    long long size = -1; /* -1 when unknown, such items are fetched whole */
+    std::string hash; /* optional, lowercase hex XXH64 of the content as returned by HttpClient::FileHash */
+};
+
+/* a request prototype made by HttpEngine::CreateRequestTemplate: the base url, method, options, resolve entries
+ * and http version are set up once on a curl handle that each request duplicates, so a request only sets its
+ * path and body; later changes to resolve entries or host versions do not reach an existing template */
+class RequestTemplate {
+public:
+    class Impl;
+
+    bool Valid() const { return impl != nullptr; }
+
+private:
+    std::shared_ptr<Impl> impl;
+
+    friend class HttpEngine;
+};
+
+/* an independent client with its own thread, connections, queues, limits and callbacks;
+ * Loop() runs the callbacks of this engine only */
+class HttpEngine {
+public:
+    class Impl;
+
+    HttpEngine();
+    ~HttpEngine();
+    HttpEngine(const HttpEngine&) = delete;
+    HttpEngine& operator=(const HttpEngine&) = delete;
+
+    void StartUp(long max_connects = 20);
+    void ShutDown();
+    void Loop();
+
+    size_t PushDownload(const std::string& url, const std::string& filepath
+            , std::function<void(bool, std::string)> callback = nullptr /* void (bool isSucceed, string filepath) */
+            , size_t block_size = 20 /* MB */
+            , bool need_resume = true);
+    size_t PushDownloadEx(const std::string& url, const std::string& filepath, const HttpOption& opt
+            , std::function<void(bool, std::string)> callback = nullptr /* void (bool isSucceed, string filepath) */
+            , size_t block_size = 20 /* MB */
+            , bool need_resume = true);
+
+    /* the same content from several urls, blocks are spread by measured throughput and fail over between them */
+    size_t PushDownloadMirrors(const std::vector<std::string>& urls, const std::string& filepath
+            , std::function<void(bool, std::string)> callback = nullptr /* void (bool isSucceed, string filepath) */
+            , size_t block_size = 20 /* MB */
+            , bool need_resume = true);
+    size_t PushDownloadMirrorsEx(const std::vector<std::string>& urls, const std::string& filepath, const HttpOption& opt
+            , std::function<void(bool, std::string)> callback = nullptr /* void (bool isSucceed, string filepath) */
+            , size_t block_size = 20 /* MB */
+            , bool need_resume = true);
+
+    /* only the blocks of url that are not found anywhere in basepath are downloaded, the rest is copied from it;
+     * manifest_url serves the output of BuildDeltaManifest for the remote file, the download does not resume */
+    size_t PushDownloadDelta(const std::string& url, const std::string& manifest_url, const std::string& basepath
+            , const std::string& filepath
+            , std::function<void(bool, std::string)> callback = nullptr /* void (bool isSucceed, string filepath) */);
+    size_t PushDownloadDeltaEx(const std::string& url, const std::string& manifest_url, const std::string& basepath
+            , const std::string& filepath, const HttpOption& opt
+            , std::function<void(bool, std::string)> callback = nullptr /* void (bool isSucceed, string filepath) */);
+
+    /* a manifest of files in one transfer: items up to small_file_size bytes skip the HEAD probe, the split
+     * and the .ftxlog and are fetched whole over the shared connections, larger ones are split as usual;
+     * finished items are kept in statepath, pushing the same manifest again only fetches the rest.
+     * one callback for the whole manifest: void (bool isSucceed, vector<string> failedFilepaths) */
+    size_t PushBulk(const std::vector<BulkItem>& items, const std::string& statepath
+            , std::function<void(bool, std::vector<std::string>)> callback = nullptr
+            , long long small_file_size = 4 * 1024 * 1024);
+    size_t PushBulkEx(const std::vector<BulkItem>& items, const std::string& statepath, const HttpOption& opt
+            , std::function<void(bool, std::vector<std::string>)> callback = nullptr
+            , long long small_file_size = 4 * 1024 * 1024);
+    /* files finished or failed, files in the manifest, bytes received by the finished files */
+    std::tuple<size_t, size_t, long long> BulkProgress(size_t id);
+
+    /* downloads queued here are logged under state_dir and survive a restart: the next SetDownloadQueue
+     * with the same state_dir resumes every unfinished file. at most max_active_files run at once and the
+     * next one starts only while its filesystem has room for it. opt is not persisted, pass it on every run.
+     * one callback for every queued file: void (bool isSucceed, string filepath).
+     * a failed file stays in the log and is retried by the next SetDownloadQueue, files already queued
+     * or running are not queued twice. a file queued while no queue is open fails at once */
+    void SetDownloadQueue(const std::string& state_dir, const HttpOption& opt
+            , std::function<void(bool, std::string)> callback = nullptr
+            , long max_active_files = 4);
+    size_t QueueDownload(const std::string& url, const std::string& filepath
+            , size_t block_size = 20 /* MB */);
+
+    /* void (bool isSucceed, string filepath, vector<string> partTags) */
+    size_t PushUpload(const std::string& filepath, const UploadOption& upload
+            , std::function<void(bool, std::string, std::vector<std::string>)> callback = nullptr
+            , size_t block_size = 20 /* MB */
+            , bool need_resume = true);
+    size_t PushUploadEx(const std::string& filepath, const UploadOption& upload, const HttpOption& opt
+            , std::function<void(bool, std::string, std::vector<std::string>)> callback = nullptr
+            , size_t block_size = 20 /* MB */
+            , bool need_resume = true);
+    void ClearUpload(const std::string& filepath);
+
+    double DownloadSpeed(const std::string& filepath);
+    double DownloadSize(const std::string& filepath);
+    std::tuple<double, double> DownloadSpeedAndSize(const std::string& filepath);
+    double DownloadAllSpeed();
+    void ClearDownload(const std::string& filepath);
+
+    /* every Push and Request returns an id, a cancelled transfer never calls back */
+    void Cancel(size_t id);
+    void CancelDownload(const std::string& filepath);
+
+    /* bytes per second, 0 means unlimited; downloads and uploads are paused to stay under the limits
+     * while requests are never paused and only consume the global and host budgets */
+    void SetSpeedLimit(long long bytes_per_sec);
+    void SetHostSpeedLimit(const std::string& host, long long bytes_per_sec);
+    /* only a download in flight, use HttpOption::maxRecvSpeed to limit one from its start */
+    void SetDownloadSpeedLimit(const std::string& filepath, long long bytes_per_sec);
+
+    void SetHedgePolicy(const HedgePolicy& policy);
+
+    /* downloads are coalesced into buffer_size chunks, at most buffer_count are in memory; call before StartUp */
+    void SetWriteBuffers(size_t buffer_size = 1024 * 1024, size_t buffer_count = 64);
+
+    /* 0 means unlimited */
+    void SetMaxHostConnections(long max_host_connects);
+    void SetMaxConcurrentStreams(long max_streams);
+    void SetMaxBulkTransfers(long max_transfers);
+    void SetHostHttpVersion(const std::string& host, HttpVersion version);
+    /* requests, downloads and uploads to host go through a unix domain socket, an empty path goes back to TCP */
+    void SetHostUnixSocket(const std::string& host, const std::string& path, bool abstract = false);
+
+    /* resolve names and open connections ahead of the first requests, e.g. "https://api.example.com/" */
+    void Prewarm(const std::vector<std::string>& urls, long connections_per_host = 1);
+    void PrewarmEx(const std::string& url, const HttpOption& opt, long connections_per_host = 1);
+
+    /* static name resolution like CURLOPT_RESOLVE, address may be a comma separated list */
+    void AddResolve(const std::string& host, int port, const std::string& address);
+    void ClearResolve();
+
+    /* void (long responseCode, string result) */
+    size_t RequestGet(const std::string& url, std::function<void(long code, std::string data)> callback = nullptr);
+    size_t RequestPost(const std::string& url, const std::string& params_str = ""
+            , std::function<void(long code, std::string data)> callback = nullptr);
+
+    size_t RequestGetEx(const std::string& url, const HttpOption& opt
+            , std::function<void(long code, std::string data)> callback = nullptr);
+    size_t RequestPostEx(const std::string& url, const HttpOption& opt
+            , const std::string& params_str = "", std::function<void(long code, std::string data)> callback = nullptr);
+
+    /* post sends the body of each request as POST, otherwise requests are GET */
+    RequestTemplate CreateRequestTemplate(const std::string& base_url, const HttpOption& opt, bool post = false);
+    /* path is appended to the base url as is, e.g. "/v1/items?id=3" */
+    size_t RequestWithTemplate(const RequestTemplate& tpl, const std::string& path, const std::string& body = ""
+            , std::function<void(long code, std::string data)> callback = nullptr);
+    /* the same requests with the headers of the final response, which are only valid during the callback:
+     * void (long responseCode, const HttpResponseHeaders& headers, string result) */
+    size_t RequestGetWithHeaders(const std::string& url, const HttpOption& opt
+            , std::function<void(long, const HttpResponseHeaders&, std::string)> callback);
+    size_t RequestPostWithHeaders(const std::string& url, const HttpOption& opt, const std::string& params_str
+            , std::function<void(long, const HttpResponseHeaders&, std::string)> callback);
+    size_t RequestWithTemplateHeaders(const RequestTemplate& tpl, const std::string& path, const std::string& body
+            , std::function<void(long, const HttpResponseHeaders&, std::string)> callback);
+
+private:
+    std::shared_ptr<Impl> impl;
+};
+
+/* parsed in place: one buffer per response, names and values are views into it */
+class HttpResponseHeaders
+{
+public:
+    /* case insensitive, the first of repeated headers */
+    HeaderView Get(const std::string& name) const;
+    size_t Count() const { return fields.size(); }
+    HeaderView Name(size_t index) const;
+    HeaderView Value(size_t index) const;
+
+private:
+    struct Field
+    {
+        size_t hash;
+        size_t nameBegin;
+        size_t nameSize;
+        size_t valueBegin;
+        size_t valueSize;
+    };
+
+    std::string raw;
+    std::vector<Field> fields;
+
+    friend class HttpEngine::Impl;
 };
 
+/* the static api drives a default engine */
 class HttpClient {
 public:
+    static HttpEngine& Default();
+
     static void StartUp(long max_connects = 20);
     static void ShutDown();
     static void Loop();
 
-    static void PushDownload(const std::string& url, const std::string& filepath
+    static size_t PushDownload(const std::string& url, const std::string& filepath
             , std::function<void(bool, std::string)> callback = nullptr /* void (bool isSucceed, string filepath) */
             , size_t block_size = 20 /* MB */
             , bool need_resume = true);
-    static void PushDownloadEx(const std::string& url, const std::string& filepath, const HttpOption& opt
+    static size_t PushDownloadEx(const std::string& url, const std::string& filepath, const HttpOption& opt
             , std::function<void(bool, std::string)> callback = nullptr /* void (bool isSucceed, string filepath) */
             , size_t block_size = 20 /* MB */
             , bool need_resume = true);
 
+    /* the same content from several urls, blocks are spread by measured throughput and fail over between them */
+    static size_t PushDownloadMirrors(const std::vector<std::string>& urls, const std::string& filepath
+            , std::function<void(bool, std::string)> callback = nullptr /* void (bool isSucceed, string filepath) */
+            , size_t block_size = 20 /* MB */
+            , bool need_resume = true);
+    static size_t PushDownloadMirrorsEx(const std::vector<std::string>& urls, const std::string& filepath, const HttpOption& opt
+            , std::function<void(bool, std::string)> callback = nullptr /* void (bool isSucceed, string filepath) */
+            , size_t block_size = 20 /* MB */
+            , bool need_resume = true);
+
+    /* only the blocks of url that are not found anywhere in basepath are downloaded, the rest is copied from it;
+     * manifest_url serves the output of BuildDeltaManifest for the remote file, the download does not resume */
+    static size_t PushDownloadDelta(const std::string& url, const std::string& manifest_url, const std::string& basepath
+            , const std::string& filepath
+            , std::function<void(bool, std::string)> callback = nullptr /* void (bool isSucceed, string filepath) */);
+    static size_t PushDownloadDeltaEx(const std::string& url, const std::string& manifest_url, const std::string& basepath
+            , const std::string& filepath, const HttpOption& opt
+            , std::function<void(bool, std::string)> callback = nullptr /* void (bool isSucceed, string filepath) */);
+
+    /* a manifest of files in one transfer: items up to small_file_size bytes skip the HEAD probe, the split
+     * and the .ftxlog and are fetched whole over the shared connections, larger ones are split as usual;
+     * finished items are kept in statepath, pushing the same manifest again only fetches the rest.
+     * one callback for the whole manifest: void (bool isSucceed, vector<string> failedFilepaths) */
+    static size_t PushBulk(const std::vector<BulkItem>& items, const std::string& statepath
+            , std::function<void(bool, std::vector<std::string>)> callback = nullptr
+            , long long small_file_size = 4 * 1024 * 1024);
+    static size_t PushBulkEx(const std::vector<BulkItem>& items, const std::string& statepath, const HttpOption& opt
+            , std::function<void(bool, std::vector<std::string>)> callback = nullptr
+            , long long small_file_size = 4 * 1024 * 1024);
+    /* files finished or failed, files in the manifest, bytes received by the finished files */
+    static std::tuple<size_t, size_t, long long> BulkProgress(size_t id);
+
+    /* downloads queued here are logged under state_dir and survive a restart: the next SetDownloadQueue
+     * with the same state_dir resumes every unfinished file. at most max_active_files run at once and the
+     * next one starts only while its filesystem has room for it. opt is not persisted, pass it on every run.
+     * one callback for every queued file: void (bool isSucceed, string filepath).
+     * a failed file stays in the log and is retried by the next SetDownloadQueue, files already queued
+     * or running are not queued twice. a file queued while no queue is open fails at once */
+    static void SetDownloadQueue(const std::string& state_dir, const HttpOption& opt
+            , std::function<void(bool, std::string)> callback = nullptr
+            , long max_active_files = 4);
+    static size_t QueueDownload(const std::string& url, const std::string& filepath
+            , size_t block_size = 20 /* MB */);
+
+    /* void (bool isSucceed, string filepath, vector<string> partTags) */
+    static size_t PushUpload(const std::string& filepath, const UploadOption& upload
+            , std::function<void(bool, std::string, std::vector<std::string>)> callback = nullptr
+            , size_t block_size = 20 /* MB */
+            , bool need_resume = true);
+    static size_t PushUploadEx(const std::string& filepath, const UploadOption& upload, const HttpOption& opt
+            , std::function<void(bool, std::string, std::vector<std::string>)> callback = nullptr
+            , size_t block_size = 20 /* MB */
+            , bool need_resume = true);
+    static void ClearUpload(const std::string& filepath);
+
     static double DownloadSpeed(const std::string& filepath);
     static double DownloadSize(const std::string& filepath);
     static std::tuple<double, double> DownloadSpeedAndSize(const std::string& filepath);
     static double DownloadAllSpeed();
     static void ClearDownload(const std::string& filepath);
 
+    /* every Push and Request returns an id, a cancelled transfer never calls back */
+    static void Cancel(size_t id);
+    static void CancelDownload(const std::string& filepath);
+
+    /* bytes per second, 0 means unlimited; downloads and uploads are paused to stay under the limits
+     * while requests are never paused and only consume the global and host budgets */
+    static void SetSpeedLimit(long long bytes_per_sec);
+    static void SetHostSpeedLimit(const std::string& host, long long bytes_per_sec);
+    /* only a download in flight, use HttpOption::maxRecvSpeed to limit one from its start */
+    static void SetDownloadSpeedLimit(const std::string& filepath, long long bytes_per_sec);
+
+    static void SetHedgePolicy(const HedgePolicy& policy);
+
+    /* downloads are coalesced into buffer_size chunks, at most buffer_count are in memory; call before StartUp */
+    static void SetWriteBuffers(size_t buffer_size = 1024 * 1024, size_t buffer_count = 64);
+    /* objects of each transfer kind built at StartUp, call before it */
+    static void SetObjectPoolCapacity(size_t capacity = 256);
+    static size_t ObjectPoolMemory();
+
+    /* 0 means unlimited */
+    static void SetMaxHostConnections(long max_host_connects);
+    static void SetMaxConcurrentStreams(long max_streams);
+    static void SetMaxBulkTransfers(long max_transfers);
+    static void SetHostHttpVersion(const std::string& host, HttpVersion version);
+    /* requests, downloads and uploads to host go through a unix domain socket, an empty path goes back to TCP */
+    static void SetHostUnixSocket(const std::string& host, const std::string& path, bool abstract = false);
+
+    /* resolve names and open connections ahead of the first requests, e.g. "https://api.example.com/" */
+    static void Prewarm(const std::vector<std::string>& urls, long connections_per_host = 1);
+    static void PrewarmEx(const std::string& url, const HttpOption& opt, long connections_per_host = 1);
+
+    /* static name resolution like CURLOPT_RESOLVE, address may be a comma separated list */
+    static void AddResolve(const std::string& host, int port, const std::string& address);
+    static void ClearResolve();
+
     static std::string FilePath2TmpPath(const std::string& filepath);
     static std::string FileLogFullPath(const std::string& filepath);
+    static std::string UploadLogFullPath(const std::string& filepath);
+
+    /* weak rolling and XXH64 sums per block of filepath, for PushDownloadDelta */
+    static bool BuildDeltaManifest(const std::string& filepath, const std::string& manifest_path
+            , long block_size = 64 * 1024);
+    /* XXH64 of the file as 16 lowercase hex digits, for BulkItem::hash */
+    static std::string FileHash(const std::string& filepath);
 
     /* void (long responseCode, string result) */
-    static void RequestGet(const std::string& url, std::function<void(long code, std::string data)> callback = nullptr);
-    static void RequestPost(const std::string& url, const std::string& params_str = ""
+    static size_t RequestGet(const std::string& url, std::function<void(long code, std::string data)> callback = nullptr);
+    static size_t RequestPost(const std::string& url, const std::string& params_str = ""
             , std::function<void(long code, std::string data)> callback = nullptr);
 
-    static void RequestGetEx(const std::string& url, const HttpOption& opt
+    static size_t RequestGetEx(const std::string& url, const HttpOption& opt
             , std::function<void(long code, std::string data)> callback = nullptr);
-    static void RequestPostEx(const std::string& url, const HttpOption& opt
+    static size_t RequestPostEx(const std::string& url, const HttpOption& opt
             , const std::string& params_str = "", std::function<void(long code, std::string data)> callback = nullptr);
 
-private:
-    static void curlPerformLoop();
-
-private:
-    static bool httpThreadAlive;
-    static long maxConnects;
-    static long maxDownloadConnects;
+    /* post sends the body of each request as POST, otherwise requests are GET */
+    static RequestTemplate CreateRequestTemplate(const std::string& base_url, const HttpOption& opt, bool post = false);
+    /* path is appended to the base url as is, e.g. "/v1/items?id=3" */
+    static size_t RequestWithTemplate(const RequestTemplate& tpl, const std::string& path, const std::string& body = ""
+            , std::function<void(long code, std::string data)> callback = nullptr);
+    /* the same requests with the headers of the final response, which are only valid during the callback:
+     * void (long responseCode, const HttpResponseHeaders& headers, string result) */
+    static size_t RequestGetWithHeaders(const std::string& url, const HttpOption& opt
+            , std::function<void(long, const HttpResponseHeaders&, std::string)> callback);
+    static size_t RequestPostWithHeaders(const std::string& url, const HttpOption& opt, const std::string& params_str
+            , std::function<void(long, const HttpResponseHeaders&, std::string)> callback);
+    static size_t RequestWithTemplateHeaders(const RequestTemplate& tpl, const std::string& path, const std::string& body
+            , std::function<void(long, const HttpResponseHeaders&, std::string)> callback);
 };
 
 }